@@ -0,0 +1,433 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "archive.hpp"
+#include "snap.hpp"
+#include "fileio.hpp"
+#include "scan.hpp"
+
+#include <map>
+#include <set>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+
+#define MANIFEST_NAME "manifest"
+#define PARTIAL_SUFFIX ".partial"
+
+string archive_path( string dir, string name ) {
+    while (dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+    return dir + "/" + name + ARCHIVE_SUFFIX;
+}
+
+static string chunk_name( unsigned index ) {
+    char buf[32];
+    snprintf( buf, sizeof(buf), "chunk-%06u.gz", index );
+    return buf;
+}
+
+static int remove_dir( string path ) {
+    DIR* dir = opendir( path.c_str() );
+    if (!dir)
+        return EXIT_FAILURE;
+    int result = EXIT_SUCCESS;
+    while (struct dirent* entry = readdir( dir )) {
+        string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+        if (unlink( (path + "/" + name).c_str() ))
+            result = EXIT_FAILURE;
+    }
+    closedir( dir );
+    if (rmdir( path.c_str() ))
+        result = EXIT_FAILURE;
+    return result;
+}
+
+int read_manifest( string path, archive_manifest& manifest ) {
+    boost::property_tree::ptree pt;
+    try {
+        boost::property_tree::ini_parser::read_ini( path + "/" + MANIFEST_NAME, pt );
+        manifest.name = pt.get<string>( "name" );
+        manifest.parent = pt.get<string>( "parent", "" );
+        manifest.uuid = pt.get<string>( "uuid", "" );
+        manifest.parent_uuid = pt.get<string>( "parent_uuid", "" );
+        manifest.bytes = pt.get<unsigned long long>( "bytes" );
+        manifest.chunks.resize( pt.get<unsigned>( "chunks" ) );
+        for (unsigned i=0; i<manifest.chunks.size(); ++i) {
+            std::istringstream line( pt.get<string>( "chunk." + chunk_name( i ).substr( 6, 6 ) ) );
+            archive_chunk& c = manifest.chunks[i];
+            line >> c.raw_bytes >> c.stored_bytes >> std::hex >> c.crc;
+            if (!line)
+                return EXIT_FAILURE;
+        }
+    } catch (boost::property_tree::ptree_error& e) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int write_manifest( string path, const archive_manifest& manifest ) {
+    std::ostringstream out;
+    out << "name = " << manifest.name << "\n"
+        << "parent = " << manifest.parent << "\n"
+        << "uuid = " << manifest.uuid << "\n"
+        << "parent_uuid = " << manifest.parent_uuid << "\n"
+        << "compression = gzip\n"
+        << "bytes = " << manifest.bytes << "\n"
+        << "chunks = " << manifest.chunks.size() << "\n"
+        << "\n[chunk]\n";
+    for (unsigned i=0; i<manifest.chunks.size(); ++i) {
+        const archive_chunk& c = manifest.chunks[i];
+        char crc[16];
+        snprintf( crc, sizeof(crc), "%08lx", c.crc );
+        out << chunk_name( i ).substr( 6, 6 ) << " = " << c.raw_bytes << " " << c.stored_bytes << " " <<
+            crc << "\n";
+    }
+    return write_whole_file( path + "/" + MANIFEST_NAME, out.str(), 0600 );
+}
+
+vector<archive_manifest> list_archives( string dir, string prefix ) {
+    while (dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+    // ordered like snapshot listings, by the time parsed from the name.
+    // the manifest is written right after the snapshot was sent, so its
+    // mtime tells the two readings of the hour the clocks repeat apart.
+    vector<std::pair<time_t, archive_manifest>> found;
+    glob_t G;
+    if (glob( (dir + "/" + prefix + "*" + ARCHIVE_SUFFIX).c_str(), 0, NULL, &G ) == 0) {
+        for (size_t i=0; i<G.gl_pathc; ++i) {
+            archive_manifest manifest;
+            struct stat st;
+            time_t time = 0;
+            if (read_manifest( G.gl_pathv[i], manifest )) {
+                WARN( "cannot read manifest of '" << G.gl_pathv[i] << "', ignoring it." );
+                continue;
+            }
+            if (stat( (string( G.gl_pathv[i] ) + "/" + MANIFEST_NAME).c_str(), &st ))
+                st.st_mtime = 0;
+            snapshot_time( manifest.name, time, st.st_mtime );
+            found.emplace_back( time, manifest );
+        }
+    }
+    globfree( &G );
+    std::sort( found.begin(), found.end(), []( const std::pair<time_t, archive_manifest>& a,
+                const std::pair<time_t, archive_manifest>& b ){
+            return a.first != b.first ? a.first < b.first : a.second.name < b.second.name; } );
+    vector<archive_manifest> result;
+    for (auto& entry: found)
+        result.push_back( entry.second );
+    return result;
+}
+
+archive_sink::archive_sink( string path_, const archive_manifest& manifest_, size_t chunk_size_,
+        int level_, unsigned threads ):
+    path( path_ ), partial( path_ + PARTIAL_SUFFIX ), manifest( manifest_ ),
+    chunk_size( std::max( chunk_size_, (size_t)1 << 16 ) ), level( level_ ) {
+    if (!threads)
+        threads = std::max( std::thread::hardware_concurrency(), 1u );
+    max_queued = 2*threads;
+    manifest.bytes = 0;
+    manifest.chunks.clear();
+    if (mkdir( partial.c_str(), 0700 ) && errno != EEXIST) {
+        ERR( "cannot create '" << partial << "': " << strerror( errno ) );
+        error = true;
+        return;
+    }
+    string tag = log_tag;
+    for (unsigned i=0; i<threads; ++i)
+        workers.emplace_back( [this, tag](){ log_tag = tag; worker(); } );
+    current.reserve( chunk_size );
+}
+
+archive_sink::~archive_sink() {
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        done = true;
+        changed.notify_all();
+    }
+    for (auto& t: workers)
+        if (t.joinable())
+            t.join();
+}
+
+void archive_sink::submit() {
+    std::unique_lock<std::mutex> lock( mutex );
+    changed.wait( lock, [&](){ return queue.size() < max_queued || error; } );
+    manifest.bytes += current.size();
+    queue.emplace_back( next_index++, std::move( current ) );
+    changed.notify_all();
+    current = string();
+    current.reserve( chunk_size );
+}
+
+void archive_sink::worker() {
+    for (;;) {
+        std::pair<unsigned, string> job;
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            changed.wait( lock, [&](){ return !queue.empty() || done; } );
+            if (queue.empty())
+                return;
+            job = std::move( queue.front() );
+            queue.pop_front();
+            changed.notify_all();
+        }
+        const string& raw = job.second;
+        archive_chunk chunk;
+        chunk.raw_bytes = raw.size();
+        chunk.crc = crc32( crc32( 0L, Z_NULL, 0 ), (const Bytef*)raw.data(), raw.size() );
+
+        z_stream z;
+        memset( &z, 0, sizeof(z) );
+        string out;
+        bool ok = deflateInit2( &z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) == Z_OK;
+        if (ok) {
+            out.resize( deflateBound( &z, raw.size() ) );
+            z.next_in = (Bytef*)raw.data();
+            z.avail_in = raw.size();
+            z.next_out = (Bytef*)&out[0];
+            z.avail_out = out.size();
+            ok = deflate( &z, Z_FINISH ) == Z_STREAM_END;
+            out.resize( z.total_out );
+            deflateEnd( &z );
+        }
+        chunk.stored_bytes = out.size();
+        if (ok)
+            ok = !write_whole_file( partial + "/" + chunk_name( job.first ), out, 0600 );
+
+        std::lock_guard<std::mutex> lock( mutex );
+        if (!ok) {
+            ERR( "cannot write " << chunk_name( job.first ) << " of '" << path << "'." );
+            error = true;
+        }
+        if (manifest.chunks.size() <= job.first)
+            manifest.chunks.resize( job.first + 1 );
+        manifest.chunks[job.first] = chunk;
+        changed.notify_all();
+    }
+}
+
+int archive_sink::write( const char* data, size_t len ) {
+    while (len) {
+        size_t n = std::min( len, chunk_size - current.size() );
+        current.append( data, n );
+        data += n;
+        len -= n;
+        if (current.size() == chunk_size)
+            submit();
+        std::lock_guard<std::mutex> lock( mutex );
+        if (error)
+            return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int archive_sink::finish( bool failed ) {
+    if (!failed && !error && !current.empty())
+        submit();
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        done = true;
+        changed.notify_all();
+    }
+    for (auto& t: workers)
+        t.join();
+    workers.clear();
+
+    if (failed || error || write_manifest( partial, manifest ) || rename( partial.c_str(), path.c_str() )) {
+        if (!failed)
+            ERR( "cannot write archive '" << path << "'." );
+        remove_dir( partial );
+        return EXIT_FAILURE;
+    }
+    INFO( "archived " << format_bytes( manifest.bytes ) << " in " << manifest.chunks.size() << " chunks to '" <<
+            path << "'" );
+    return EXIT_SUCCESS;
+}
+
+static int decompress_chunk( string path, unsigned index, const archive_chunk& chunk, string& raw ) {
+    string stored;
+    if (read_whole_file( path + "/" + chunk_name( index ), stored ) || stored.size() != chunk.stored_bytes) {
+        ERR( "cannot read " << chunk_name( index ) << " of '" << path << "'." );
+        return EXIT_FAILURE;
+    }
+    raw.resize( chunk.raw_bytes );
+    z_stream z;
+    memset( &z, 0, sizeof(z) );
+    bool ok = inflateInit2( &z, 15 + 16 ) == Z_OK;
+    if (ok) {
+        z.next_in = (Bytef*)stored.data();
+        z.avail_in = stored.size();
+        z.next_out = (Bytef*)&raw[0];
+        z.avail_out = raw.size();
+        ok = inflate( &z, Z_FINISH ) == Z_STREAM_END && z.total_out == chunk.raw_bytes;
+        inflateEnd( &z );
+    }
+    if (!ok || crc32( crc32( 0L, Z_NULL, 0 ), (const Bytef*)raw.data(), raw.size() ) != chunk.crc) {
+        ERR( chunk_name( index ) << " of '" << path << "' is corrupt." );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+// streams one archive into btrfs receive
+static int restore_one( string path, const archive_manifest& manifest, string dest_dir, unsigned threads ) {
+    process_sink receiver( { "btrfs", "receive", dest_dir } );
+    if (!receiver.started())
+        return receiver.finish( true );
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::map<unsigned, string> ready;
+    unsigned next_job = 0, next_write = 0;
+    bool failed = false;
+    unsigned window = 2*threads;
+
+    auto worker = [&]( string tag ){
+        log_tag = tag;
+        for (;;) {
+            unsigned index;
+            {
+                std::unique_lock<std::mutex> lock( mutex );
+                changed.wait( lock, [&](){ return failed || next_job >= manifest.chunks.size() ||
+                        next_job < next_write + window; } );
+                if (failed || next_job >= manifest.chunks.size())
+                    return;
+                index = next_job++;
+            }
+            string raw;
+            int result = decompress_chunk( path, index, manifest.chunks[index], raw );
+            std::lock_guard<std::mutex> lock( mutex );
+            if (result)
+                failed = true;
+            else
+                ready[index] = std::move( raw );
+            changed.notify_all();
+        }
+    };
+    vector<std::thread> workers;
+    for (unsigned i=0; i<threads; ++i)
+        workers.emplace_back( worker, log_tag );
+
+    while (next_write < manifest.chunks.size()) {
+        string raw;
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            changed.wait( lock, [&](){ return failed || ready.count( next_write ); } );
+            if (failed)
+                break;
+            raw = std::move( ready[next_write] );
+            ready.erase( next_write );
+        }
+        int result = receiver.write( raw.data(), raw.size() );
+        std::lock_guard<std::mutex> lock( mutex );
+        if (result) {
+            failed = true;
+            changed.notify_all();
+            break;
+        }
+        next_write++;
+        changed.notify_all();
+    }
+    for (auto& t: workers)
+        t.join();
+    int result = receiver.finish( failed );
+    return (failed || result) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int archive_restore( string path, string dest_dir, unsigned threads, bool dry_run ) {
+    while (path.size() > 1 && path.back() == '/')
+        path.pop_back();
+    string dir = path.substr( 0, path.rfind( '/' ) + 1 );
+    if (!threads)
+        threads = std::max( std::thread::hardware_concurrency(), 1u );
+
+    // walk up to the first parent that is already restored (or the full
+    // stream) and receive from there.
+    vector<std::pair<string, archive_manifest>> chain;
+    string current = path;
+    for (;;) {
+        archive_manifest manifest;
+        if (read_manifest( current, manifest )) {
+            ERR( "cannot read archive '" << current << "'." );
+            return EXIT_FAILURE;
+        }
+        chain.emplace_back( current, manifest );
+        if (manifest.parent == "")
+            break;
+        struct stat st;
+        if (stat( (dest_dir + "/" + manifest.parent).c_str(), &st ) == 0)
+            break;
+        current = archive_path( dir, manifest.parent );
+    }
+    std::reverse( chain.begin(), chain.end() );
+
+    for (auto& link: chain) {
+        INFO( "restoring '" << link.first << "' (" << format_bytes( link.second.bytes ) << ", " <<
+                (link.second.parent == "" ? string( "full" ) : "parent " + link.second.parent) <<
+                ") to '" << dest_dir << "'" );
+        if (dry_run)
+            continue;
+        if (restore_one( link.first, link.second, dest_dir, threads ))
+            return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int archive_retention( string dir, string prefix, unsigned keep, bool dry_run ) {
+    vector<archive_manifest> archives = list_archives( dir, prefix );
+    std::map<string, const archive_manifest*> by_name;
+    for (auto& a: archives)
+        by_name[a.name] = &a;
+
+    // newest keep archives and every parent they depend on stay
+    std::set<string> needed;
+    for (size_t i=archives.size() > keep ? archives.size()-keep : 0; i<archives.size(); ++i) {
+        const archive_manifest* a = &archives[i];
+        while (a && needed.insert( a->name ).second) {
+            auto parent = by_name.find( a->parent );
+            a = parent == by_name.end() ? NULL : parent->second;
+        }
+    }
+
+    int result = EXIT_SUCCESS;
+    for (auto& a: archives) {
+        if (needed.count( a.name ))
+            continue;
+        string path = archive_path( dir, a.name );
+        INFO( "rm -r " << path );
+        if (!dry_run && remove_dir( path )) {
+            ERR( "cannot delete archive '" << path << "'." );
+            result = EXIT_FAILURE;
+        }
+    }
+    size_t chained = needed.size() > keep ? needed.size() - keep : 0;
+    if (chained)
+        INFO( "keeping " << chained << " older archives needed as parents." );
+
+    while (dir.size() > 1 && dir.back() == '/')
+        dir.pop_back();
+    glob_t G;
+    if (glob( (dir + "/" + prefix + "*" + ARCHIVE_SUFFIX + PARTIAL_SUFFIX).c_str(), 0, NULL, &G ) == 0) {
+        for (size_t i=0; i<G.gl_pathc; ++i) {
+            INFO( "rm -r " << G.gl_pathv[i] << " (incomplete archive)" );
+            if (!dry_run && remove_dir( G.gl_pathv[i] ))
+                result = EXIT_FAILURE;
+        }
+    }
+    globfree( &G );
+    return result;
+}
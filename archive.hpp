@@ -0,0 +1,79 @@
+#pragma once
+
+#include "transfer.hpp"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+using std::string;
+using std::vector;
+
+// a send stream stored as gzip compressed chunk files plus a manifest in
+// <dir>/<name>.archive/, for backup disks that cannot btrfs receive. the
+// manifest records the parent the stream was sent against, so archives
+// form chains that end in a full stream.
+struct archive_chunk {
+    unsigned long long raw_bytes = 0;
+    unsigned long long stored_bytes = 0;
+    unsigned long crc = 0; // crc32 of the uncompressed chunk
+};
+
+struct archive_manifest {
+    string name;
+    string parent; // empty for a full stream
+    string uuid; // of the local snapshot that was sent
+    string parent_uuid;
+    unsigned long long bytes = 0;
+    vector<archive_chunk> chunks;
+};
+
+#define ARCHIVE_SUFFIX ".archive"
+
+// path of the archive for snapshot name in dir
+string archive_path( string dir, string name );
+int read_manifest( string path, archive_manifest& manifest );
+// complete archives in dir whose name starts with prefix, oldest first
+vector<archive_manifest> list_archives( string dir, string prefix );
+
+// writes the stream into chunks of chunk_size bytes that a pool of threads
+// compresses and checksums. the archive is assembled under a .partial name
+// and only renamed into place once the manifest is written.
+class archive_sink: public stream_sink {
+    public:
+        archive_sink( string path, const archive_manifest& manifest, size_t chunk_size, int level,
+                unsigned threads );
+        ~archive_sink();
+        int write( const char* data, size_t len ) override;
+        int finish( bool failed ) override;
+    private:
+        void submit();
+        void worker();
+
+        string path;
+        string partial;
+        archive_manifest manifest;
+        size_t chunk_size;
+        int level;
+        string current;
+        unsigned next_index = 0;
+        unsigned max_queued;
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<std::pair<unsigned, string>> queue;
+        bool done = false;
+        bool error = false;
+        vector<std::thread> workers;
+};
+
+// receives the archive at path into dest_dir with btrfs receive, after its
+// parents that are not in dest_dir yet. chunks are decompressed and verified
+// by a pool of threads and streamed in order.
+int archive_restore( string path, string dest_dir, unsigned threads, bool dry_run );
+
+// deletes all but the newest keep archives with prefix in dir, except those
+// a kept archive still needs as parent. also removes leftover .partial dirs.
+int archive_retention( string dir, string prefix, unsigned keep, bool dry_run );
@@ -0,0 +1,636 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "backend.hpp"
+#include "proc.hpp"
+#include "snap.hpp"
+#include "transfer.hpp"
+#include "scan.hpp"
+#include "fileio.hpp"
+
+#include <map>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+
+// splits "/a/b/c/" into "/a/b" and "c"
+static void split_path( string path, string& parent, string& base ) {
+    while (path.size() > 1 && path.back() == '/')
+        path.pop_back();
+    size_t pos = path.rfind( '/' );
+    if (pos == string::npos) {
+        parent = ".";
+        base = path;
+    } else {
+        parent = pos ? path.substr( 0, pos ) : "/";
+        base = path.substr( pos + 1 );
+    }
+}
+
+static string ioctl_error( int err ) {
+    switch (err) {
+        case ENOTTY:
+            return "not a btrfs file system or ioctl unsupported";
+        case EXDEV:
+            return "source and destination are on different file systems";
+        case EEXIST:
+            return "destination already exists";
+        case ENOENT:
+            return "no such subvolume";
+        case EPERM:
+        case EACCES:
+            return "permission denied";
+        case ENOTEMPTY:
+            return "subvolume contains other subvolumes";
+        case EROFS:
+            return "file system is read-only";
+        case ENOSPC:
+            return "no space left on device";
+        case EINVAL:
+            return "not a subvolume or invalid name";
+        default:
+            return strerror( err );
+    }
+}
+
+// groups paths by parent directory, keeping the order within a directory
+static std::map<string, vector<string>> group_by_parent( const vector<string>& paths ) {
+    std::map<string, vector<string>> groups;
+    for (auto& path: paths) {
+        string parent, base;
+        split_path( path, parent, base );
+        groups[parent].push_back( base );
+    }
+    return groups;
+}
+
+// errors after which the cli is worth a try
+static bool ioctl_unsupported( int err ) {
+    return err == ENOTTY || err == EOPNOTSUPP || err == ENOSYS;
+}
+
+int btrfs_cli_backend::create_snapshot( string source, string dest, bool read_only ) {
+    vector<string> argv = { "btrfs", "subvolume", "snapshot" };
+    if (read_only)
+        argv.push_back( "-r" );
+    argv.push_back( source );
+    argv.push_back( dest );
+    return run_process( argv );
+}
+
+int btrfs_backend::delete_snapshots( const vector<string>& paths ) {
+    int result = EXIT_SUCCESS;
+    for (auto& path: paths)
+        if (delete_snapshot( path ))
+            result = EXIT_FAILURE;
+    return result;
+}
+
+int btrfs_cli_backend::delete_snapshot( string path ) {
+    return run_process( { "btrfs", "subvolume", "delete", path } );
+}
+
+int btrfs_cli_backend::delete_snapshots( const vector<string>& paths ) {
+    int result = EXIT_SUCCESS;
+    for (auto& group: group_by_parent( paths )) {
+        vector<string> argv = { "btrfs", "subvolume", "delete" };
+        for (auto& base: group.second)
+            argv.push_back( group.first + "/" + base );
+        if (run_process( argv ))
+            result = EXIT_FAILURE;
+    }
+    return result;
+}
+
+// returns 0 or errno
+static int ioctl_create( string source, string dest, bool read_only ) {
+    string parent, base;
+    split_path( dest, parent, base );
+    if (base.size() > BTRFS_SUBVOL_NAME_MAX)
+        return ENAMETOOLONG;
+    int src_fd = open( source.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (src_fd < 0)
+        return errno;
+    int parent_fd = open( parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (parent_fd < 0) {
+        int err = errno;
+        close( src_fd );
+        return err;
+    }
+    struct btrfs_ioctl_vol_args_v2 args;
+    memset( &args, 0, sizeof(args) );
+    args.fd = src_fd;
+    args.flags = read_only ? BTRFS_SUBVOL_RDONLY : 0;
+    strncpy( args.name, base.c_str(), BTRFS_SUBVOL_NAME_MAX );
+    int err = ioctl( parent_fd, BTRFS_IOC_SNAP_CREATE_V2, &args ) ? errno : 0;
+    close( parent_fd );
+    close( src_fd );
+    return err;
+}
+
+static int ioctl_delete_at( int parent_fd, string base ) {
+    if (base.size() > BTRFS_SUBVOL_NAME_MAX)
+        return ENAMETOOLONG;
+    struct btrfs_ioctl_vol_args_v2 args;
+    memset( &args, 0, sizeof(args) );
+    strncpy( args.name, base.c_str(), BTRFS_SUBVOL_NAME_MAX );
+    int err = ioctl( parent_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args ) ? errno : 0;
+    if (ioctl_unsupported( err ) || err == EINVAL) {
+        // kernels before 5.7 only know the v1 ioctl
+        struct btrfs_ioctl_vol_args args_v1;
+        memset( &args_v1, 0, sizeof(args_v1) );
+        strncpy( args_v1.name, base.c_str(), BTRFS_PATH_NAME_MAX );
+        err = ioctl( parent_fd, BTRFS_IOC_SNAP_DESTROY, &args_v1 ) ? errno : 0;
+    }
+    return err;
+}
+
+static int ioctl_delete( string path ) {
+    string parent, base;
+    split_path( path, parent, base );
+    int parent_fd = open( parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (parent_fd < 0)
+        return errno;
+    int err = ioctl_delete_at( parent_fd, base );
+    close( parent_fd );
+    return err;
+}
+
+// number of orphan items in the root tree, i.e. deleted subvolumes whose
+// extents the cleaner thread still has to free.
+static long ioctl_pending_deletions( string path ) {
+    int fd = open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (fd < 0)
+        return -1;
+    struct btrfs_ioctl_search_args args;
+    memset( &args, 0, sizeof(args) );
+    struct btrfs_ioctl_search_key& key = args.key;
+    key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+    key.min_objectid = key.max_objectid = BTRFS_ORPHAN_OBJECTID;
+    key.min_type = key.max_type = BTRFS_ORPHAN_ITEM_KEY;
+    key.max_offset = (__u64)-1;
+    key.max_transid = (__u64)-1;
+    long count = 0;
+    for (;;) {
+        key.nr_items = 4096;
+        if (ioctl( fd, BTRFS_IOC_TREE_SEARCH, &args )) {
+            count = -1;
+            break;
+        }
+        if (key.nr_items == 0)
+            break;
+        count += key.nr_items;
+        // continue after the last returned item
+        unsigned long off = 0;
+        struct btrfs_ioctl_search_header header;
+        for (unsigned i=0; i<key.nr_items; ++i) {
+            memcpy( &header, args.buf + off, sizeof(header) );
+            off += sizeof(header) + header.len;
+        }
+        if (header.offset == (__u64)-1)
+            break;
+        key.min_offset = header.offset + 1;
+    }
+    close( fd );
+    return count;
+}
+
+int btrfs_ioctl_backend::create_snapshot( string source, string dest, bool read_only ) {
+    int err = ioctl_create( source, dest, read_only );
+    if (err)
+        ERR( "cannot snapshot '" << source << "' to '" << dest << "': " << ioctl_error( err ) );
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int btrfs_ioctl_backend::delete_snapshot( string path ) {
+    int err = ioctl_delete( path );
+    if (err)
+        ERR( "cannot delete '" << path << "': " << ioctl_error( err ) );
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int btrfs_ioctl_backend::delete_snapshots( const vector<string>& paths ) {
+    int result = EXIT_SUCCESS;
+    for (auto& group: group_by_parent( paths )) {
+        int parent_fd = open( group.first.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+        if (parent_fd < 0) {
+            ERR( "cannot open '" << group.first << "': " << strerror( errno ) );
+            result = EXIT_FAILURE;
+            continue;
+        }
+        for (auto& base: group.second) {
+            int err = ioctl_delete_at( parent_fd, base );
+            if (err) {
+                ERR( "cannot delete '" << group.first << "/" << base << "': " << ioctl_error( err ) );
+                result = EXIT_FAILURE;
+            }
+        }
+        close( parent_fd );
+    }
+    return result;
+}
+
+long btrfs_ioctl_backend::pending_deletions( string path ) {
+    return ioctl_pending_deletions( path );
+}
+
+static string uuid_string( const __u8* uuid ) {
+    static const char hex[] = "0123456789abcdef";
+    string result( 2*BTRFS_UUID_SIZE, '0' );
+    bool zero = true;
+    for (int i=0; i<BTRFS_UUID_SIZE; ++i) {
+        result[2*i] = hex[uuid[i] >> 4];
+        result[2*i+1] = hex[uuid[i] & 0xf];
+        zero = zero && !uuid[i];
+    }
+    return zero ? "" : result;
+}
+
+int btrfs_ioctl_backend::get_subvolume_info( string path, subvolume_info& info ) {
+    int fd = open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (fd < 0)
+        return EXIT_FAILURE;
+    struct btrfs_ioctl_get_subvol_info_args args;
+    memset( &args, 0, sizeof(args) );
+    int err = ioctl( fd, BTRFS_IOC_GET_SUBVOL_INFO, &args );
+    close( fd );
+    if (err)
+        return EXIT_FAILURE;
+    info.id = args.treeid;
+    info.uuid = uuid_string( args.uuid );
+    info.parent_uuid = uuid_string( args.parent_uuid );
+    info.received_uuid = uuid_string( args.received_uuid );
+    info.generation = args.generation;
+    info.ctransid = args.ctransid;
+    info.otransid = args.otransid;
+    info.stransid = args.stransid;
+    info.rtransid = args.rtransid;
+    info.read_only = args.flags & BTRFS_SUBVOL_RDONLY;
+    return EXIT_SUCCESS;
+}
+
+int btrfs_ioctl_backend::get_qgroup_usage( string path, unsigned long long& referenced,
+        unsigned long long& exclusive ) {
+    subvolume_info info;
+    if (get_subvolume_info( path, info ))
+        return EXIT_FAILURE;
+    int fd = open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (fd < 0)
+        return EXIT_FAILURE;
+    // the level 0 qgroup of a subvolume has its id
+    struct btrfs_ioctl_search_args args;
+    memset( &args, 0, sizeof(args) );
+    struct btrfs_ioctl_search_key& key = args.key;
+    key.tree_id = BTRFS_QUOTA_TREE_OBJECTID;
+    key.min_type = key.max_type = BTRFS_QGROUP_INFO_KEY;
+    key.min_offset = key.max_offset = info.id;
+    key.max_transid = (__u64)-1;
+    key.nr_items = 1;
+    int err = ioctl( fd, BTRFS_IOC_TREE_SEARCH, &args );
+    close( fd );
+    struct btrfs_ioctl_search_header header;
+    struct btrfs_qgroup_info_item item;
+    memcpy( &header, args.buf, sizeof(header) );
+    if (err || key.nr_items != 1 || header.len < sizeof(item))
+        return EXIT_FAILURE;
+    memcpy( &item, args.buf + sizeof(header), sizeof(item) );
+    referenced = le64toh( item.rfer );
+    exclusive = le64toh( item.excl );
+    return EXIT_SUCCESS;
+}
+
+int btrfs_ioctl_backend::get_space_usage( const vector<string>& paths, vector<space_usage>& usage ) {
+    usage.assign( paths.size(), space_usage() );
+    std::map<__u64, vector<size_t>> ids;
+    for (size_t i=0; i<paths.size(); ++i) {
+        subvolume_info info;
+        if (!get_subvolume_info( paths[i], info ))
+            ids[info.id].push_back( i );
+    }
+    if (ids.empty())
+        return EXIT_FAILURE;
+    int fd = open( paths[ids.begin()->second[0]].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (fd < 0)
+        return EXIT_FAILURE;
+    // the level 0 qgroups between the smallest and the largest id, a
+    // buffer full per call
+    struct btrfs_ioctl_search_args args;
+    memset( &args, 0, sizeof(args) );
+    struct btrfs_ioctl_search_key& key = args.key;
+    key.tree_id = BTRFS_QUOTA_TREE_OBJECTID;
+    key.min_type = key.max_type = BTRFS_QGROUP_INFO_KEY;
+    key.min_offset = ids.begin()->first;
+    key.max_offset = ids.rbegin()->first;
+    key.max_transid = (__u64)-1;
+    bool found = false;
+    for (;;) {
+        key.nr_items = 4096;
+        if (ioctl( fd, BTRFS_IOC_TREE_SEARCH, &args ) || key.nr_items == 0)
+            break;
+        size_t pos = 0;
+        __u64 last = 0;
+        for (unsigned i=0; i<key.nr_items; ++i) {
+            struct btrfs_ioctl_search_header header;
+            memcpy( &header, args.buf + pos, sizeof(header) );
+            pos += sizeof(header);
+            auto wanted = ids.find( header.offset );
+            struct btrfs_qgroup_info_item item;
+            if (header.type == BTRFS_QGROUP_INFO_KEY && header.len >= sizeof(item) && wanted != ids.end()) {
+                memcpy( &item, args.buf + pos, sizeof(item) );
+                for (size_t index: wanted->second) {
+                    usage[index].known = true;
+                    usage[index].referenced = le64toh( item.rfer );
+                    usage[index].exclusive = le64toh( item.excl );
+                }
+                found = true;
+            }
+            pos += header.len;
+            last = header.offset;
+        }
+        if (last >= key.max_offset)
+            break;
+        key.min_offset = last + 1;
+    }
+    close( fd );
+    return found ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+class btrfs_auto_backend: public btrfs_backend {
+    public:
+        string name() const override { return "auto"; }
+        int create_snapshot( string source, string dest, bool read_only ) override {
+            int err = ioctl_create( source, dest, read_only );
+            if (ioctl_unsupported( err )) {
+                WARN( "snapshot ioctl unsupported, falling back to btrfs tool." );
+                return cli.create_snapshot( source, dest, read_only );
+            }
+            if (err)
+                ERR( "cannot snapshot '" << source << "' to '" << dest << "': " << ioctl_error( err ) );
+            return err ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+        int delete_snapshot( string path ) override {
+            int err = ioctl_delete( path );
+            if (ioctl_unsupported( err )) {
+                WARN( "subvolume delete ioctl unsupported, falling back to btrfs tool." );
+                return cli.delete_snapshot( path );
+            }
+            if (err)
+                ERR( "cannot delete '" << path << "': " << ioctl_error( err ) );
+            return err ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+        int delete_snapshots( const vector<string>& paths ) override {
+            if (paths.empty())
+                return EXIT_SUCCESS;
+            int err = ioctl_delete( paths[0] );
+            if (ioctl_unsupported( err )) {
+                WARN( "subvolume delete ioctl unsupported, falling back to btrfs tool." );
+                return cli.delete_snapshots( paths );
+            }
+            if (err)
+                ERR( "cannot delete '" << paths[0] << "': " << ioctl_error( err ) );
+            int rest = ioctl.delete_snapshots( vector<string>( paths.begin()+1, paths.end() ) );
+            return (err || rest) ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+        long pending_deletions( string path ) override {
+            return ioctl.pending_deletions( path );
+        }
+        int get_subvolume_info( string path, subvolume_info& info ) override {
+            return ioctl.get_subvolume_info( path, info );
+        }
+        int get_qgroup_usage( string path, unsigned long long& referenced,
+                unsigned long long& exclusive ) override {
+            return ioctl.get_qgroup_usage( path, referenced, exclusive );
+        }
+        int get_space_usage( const vector<string>& paths, vector<space_usage>& usage ) override {
+            return ioctl.get_space_usage( paths, usage );
+        }
+    private:
+        btrfs_ioctl_backend ioctl;
+        btrfs_cli_backend cli;
+};
+
+stream_sink* btrfs_backend::receive_sink( string dir, string name ) {
+    (void)name;
+    return new process_sink( receive_pipeline( dir ) );
+}
+
+int btrfs_backend::sync_paths( const vector<string>& paths ) {
+    return sync_filesystems( paths );
+}
+
+int btrfs_backend::get_space_usage( const vector<string>& paths, vector<space_usage>& usage ) {
+    usage.assign( paths.size(), space_usage() );
+    bool found = false;
+    for (size_t i=0; i<paths.size(); ++i) {
+        usage[i].known = !get_qgroup_usage( paths[i], usage[i].referenced, usage[i].exclusive );
+        found = found || usage[i].known;
+    }
+    return found ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+vector<string> btrfs_backend::list_snapshots( string dir, string prefix ) {
+    return snapshot_paths( dir, prefix );
+}
+
+bool btrfs_backend::directory_exists( string dir ) {
+    struct stat st;
+    return stat( dir.c_str(), &st ) == 0 && S_ISDIR( st.st_mode );
+}
+
+int btrfs_backend::read_file( string path, string& contents ) {
+    if (read_whole_file( path, contents ))
+        return errno == ENOENT ? EXIT_SUCCESS : EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+int btrfs_backend::write_file( string path, const string& contents ) {
+    return replace_file( path, contents );
+}
+
+#define MOCK_PARTIAL ".mock-receiving"
+
+void btrfs_mock_backend::delay() const {
+    if (latency_ms)
+        std::this_thread::sleep_for( std::chrono::milliseconds( latency_ms ) );
+}
+
+int btrfs_mock_backend::create_snapshot( string source, string dest, bool read_only ) {
+    (void)read_only;
+    delay();
+    if (mkdir( dest.c_str(), 0755 )) {
+        ERR( "cannot snapshot '" << source << "' to '" << dest << "': " << strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    // the mtime of a directory stands in for its generation
+    struct stat st;
+    if (!stat( source.c_str(), &st )) {
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        utimensat( AT_FDCWD, dest.c_str(), times, 0 );
+    }
+    return EXIT_SUCCESS;
+}
+
+int btrfs_mock_backend::delete_snapshot( string path ) {
+    delay();
+    unlink( (path + "/" MOCK_PARTIAL).c_str() );
+    if (rmdir( path.c_str() )) {
+        ERR( "cannot delete '" << path << "': " << strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int btrfs_mock_backend::get_subvolume_info( string path, subvolume_info& info ) {
+    struct stat st;
+    if (stat( path.c_str(), &st ) || !S_ISDIR( st.st_mode ))
+        return EXIT_FAILURE;
+    char uuid[33];
+    snprintf( uuid, sizeof(uuid), "%032zx", std::hash<string>()( base_name( path ) ) );
+    info = subvolume_info();
+    info.id = st.st_ino;
+    info.uuid = info.received_uuid = uuid;
+    info.generation = info.ctransid = info.otransid = st.st_mtime;
+    info.read_only = access( (path + "/" MOCK_PARTIAL).c_str(), F_OK ) != 0;
+    return EXIT_SUCCESS;
+}
+
+int btrfs_mock_backend::get_qgroup_usage( string path, unsigned long long& referenced,
+        unsigned long long& exclusive ) {
+    struct stat st;
+    if (stat( path.c_str(), &st ) || !S_ISDIR( st.st_mode ))
+        return EXIT_FAILURE;
+    referenced = exclusive = stream_size;
+    return EXIT_SUCCESS;
+}
+
+vector<string> btrfs_mock_backend::send_command( const vector<string>& command ) {
+    (void)command;
+    return { "head", "-c", std::to_string( stream_size.load() ), "/dev/zero" };
+}
+
+namespace {
+class mock_receive_sink: public stream_sink {
+    public:
+        mock_receive_sink( string path_, unsigned latency_ms ): path( path_ ) {
+            std::this_thread::sleep_for( std::chrono::milliseconds( latency_ms ) );
+            if (mkdir( path.c_str(), 0755 ) == 0)
+                close( open( (path + "/" MOCK_PARTIAL).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644 ) );
+            else
+                failed = true;
+        }
+        int write( const char* data, size_t len ) override {
+            (void)data; (void)len;
+            return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+        int finish( bool aborted ) override {
+            if (failed || aborted) {
+                ERR( "mock receive of '" << path << "' failed." );
+                return EXIT_FAILURE;
+            }
+            return unlink( (path + "/" MOCK_PARTIAL).c_str() ) ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+    private:
+        string path;
+        bool failed = false;
+};
+}
+
+stream_sink* btrfs_mock_backend::receive_sink( string dir, string name ) {
+    if (dir.size() && dir.back() != '/')
+        dir += "/";
+    return new mock_receive_sink( dir + name, latency_ms );
+}
+
+int btrfs_mock_backend::sync_paths( const vector<string>& paths ) {
+    (void)paths;
+    delay();
+    return EXIT_SUCCESS;
+}
+
+btrfs_backend* get_backend( string name ) {
+    static btrfs_cli_backend cli;
+    static btrfs_mock_backend mock;
+    static btrfs_ioctl_backend ioctl_backend;
+    static btrfs_auto_backend auto_backend;
+    if (name == "cli")
+        return &cli;
+    if (name == "ioctl")
+        return &ioctl_backend;
+    if (name == "auto")
+        return &auto_backend;
+    if (name == "mock")
+        return &mock;
+    return NULL;
+}
+
+string fs_identity( string path ) {
+    int fd = open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (fd < 0)
+        return "";
+    string result = "";
+    struct btrfs_ioctl_fs_info_args info = {};
+    if (ioctl( fd, BTRFS_IOC_FS_INFO, &info ) == 0) {
+        char buf[2*BTRFS_FSID_SIZE+1];
+        for (int i=0; i<BTRFS_FSID_SIZE; ++i)
+            snprintf( buf+2*i, 3, "%02x", info.fsid[i] );
+        result = "btrfs:" + string(buf);
+    } else {
+        struct stat st;
+        if (fstat( fd, &st ) == 0)
+            result = "dev:" + std::to_string( (unsigned long long)st.st_dev );
+    }
+    close( fd );
+    return result;
+}
+
+static int sync_one( string path ) {
+    int fd = open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (fd < 0) {
+        ERR( "cannot open '" << path << "': " << strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    // BTRFS_IOC_SYNC flushes delalloc and commits the transaction; other
+    // file systems (archive targets) get syncfs().
+    int err = ioctl( fd, BTRFS_IOC_SYNC, NULL ) ? errno : 0;
+    if (err == ENOTTY || err == EOPNOTSUPP || err == EINVAL)
+        err = syncfs( fd ) ? errno : 0;
+    close( fd );
+    if (err) {
+        ERR( "cannot sync '" << path << "': " << strerror( err ) );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int sync_filesystems( const vector<string>& paths ) {
+    std::map<string, string> filesystems;
+    for (auto& path: paths)
+        filesystems.emplace( fs_identity( path ), path );
+    vector<std::thread> threads;
+    std::atomic<bool> failed( false );
+    string tag = log_tag;
+    for (auto& fs: filesystems) {
+        string path = fs.second;
+        threads.emplace_back( [&, path, tag](){
+            log_tag = tag;
+            if (sync_one( path ))
+                failed = true;
+        } );
+    }
+    for (auto& t: threads)
+        t.join();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
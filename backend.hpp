@@ -0,0 +1,142 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <atomic>
+
+using std::string;
+using std::vector;
+
+class stream_sink;
+
+// what BTRFS_IOC_GET_SUBVOL_INFO reports about a subvolume. uuids are hex
+// strings, empty if unset; transids of 0 are unknown.
+struct subvolume_info {
+    unsigned long long id = 0;
+    string uuid;
+    string parent_uuid;
+    string received_uuid;
+    unsigned long long generation = 0;
+    unsigned long long ctransid = 0;
+    unsigned long long otransid = 0;
+    unsigned long long stransid = 0;
+    unsigned long long rtransid = 0;
+    bool read_only = false;
+};
+
+// bytes a subvolume references and holds exclusively, by its qgroup
+struct space_usage {
+    bool known = false;
+    unsigned long long referenced = 0;
+    unsigned long long exclusive = 0;
+};
+
+// subvolume operations. the ioctl backend talks to the kernel directly, the
+// cli backend runs the btrfs tool and is used as a fallback wherever the
+// kernel does not support an ioctl.
+class btrfs_backend {
+    public:
+        virtual ~btrfs_backend() {}
+        virtual string name() const = 0;
+        // snapshot of subvolume source at dest (the new path, its parent has
+        // to exist).
+        virtual int create_snapshot( string source, string dest, bool read_only ) = 0;
+        virtual int delete_snapshot( string path ) = 0;
+        // deletes all paths with one operation per parent directory where
+        // the backend can batch. failures do not stop the batch, the result
+        // is EXIT_FAILURE if any deletion failed.
+        virtual int delete_snapshots( const vector<string>& paths );
+        // subvolumes deleted on the file system of path that the btrfs
+        // cleaner has not processed yet, -1 if unknown.
+        virtual long pending_deletions( string path ) { (void)path; return -1; }
+        // fills info for the subvolume at path. EXIT_FAILURE if the path is
+        // no subvolume or the backend cannot tell.
+        virtual int get_subvolume_info( string path, subvolume_info& info ) {
+            (void)path; (void)info; return EXIT_FAILURE;
+        }
+        // bytes the subvolume at path references and holds exclusively
+        // according to its qgroup. EXIT_FAILURE if quotas are off.
+        virtual int get_qgroup_usage( string path, unsigned long long& referenced,
+                unsigned long long& exclusive ) {
+            (void)path; (void)referenced; (void)exclusive; return EXIT_FAILURE;
+        }
+        // get_qgroup_usage() of each of paths, which live on one file
+        // system. entries stay unknown where it fails; EXIT_FAILURE if none
+        // is known.
+        virtual int get_space_usage( const vector<string>& paths, vector<space_usage>& usage );
+        // the process producing the stream of a btrfs send command line
+        virtual vector<string> send_command( const vector<string>& command ) { return command; }
+        // the processes a stream into dir is piped through
+        virtual vector<vector<string>> receive_pipeline( string dir ) { return { { "btrfs", "receive", dir } }; }
+        // consumer that receives the stream of snapshot name into dir
+        virtual stream_sink* receive_sink( string dir, string name );
+        // flushes the file systems of paths (sync_filesystems())
+        virtual int sync_paths( const vector<string>& paths );
+        // the snapshots of series prefix in dir as "dir/name/", oldest
+        // first (snapshot_paths())
+        virtual vector<string> list_snapshots( string dir, string prefix );
+        virtual bool directory_exists( string dir );
+        // small bookkeeping files next to the snapshots. a missing file
+        // reads as empty; writes replace the file atomically.
+        virtual int read_file( string path, string& contents );
+        virtual int write_file( string path, const string& contents );
+};
+
+class btrfs_cli_backend: public btrfs_backend {
+    public:
+        string name() const override { return "cli"; }
+        int create_snapshot( string source, string dest, bool read_only ) override;
+        int delete_snapshot( string path ) override;
+        int delete_snapshots( const vector<string>& paths ) override;
+};
+
+class btrfs_ioctl_backend: public btrfs_backend {
+    public:
+        string name() const override { return "ioctl"; }
+        int create_snapshot( string source, string dest, bool read_only ) override;
+        int delete_snapshot( string path ) override;
+        int delete_snapshots( const vector<string>& paths ) override;
+        long pending_deletions( string path ) override;
+        int get_subvolume_info( string path, subvolume_info& info ) override;
+        int get_qgroup_usage( string path, unsigned long long& referenced,
+                unsigned long long& exclusive ) override;
+        // one tree search over the quota tree for all of them
+        int get_space_usage( const vector<string>& paths, vector<space_usage>& usage ) override;
+};
+
+// simulates subvolumes with plain directories so runs and benchmarks need
+// neither root nor btrfs. every operation takes latency_ms, sends produce
+// stream_size zero bytes from a real process and receives discard them.
+// uuids derive from the snapshot name, so a received copy matches its
+// source; a receive in progress leaves a marker that makes it writable.
+class btrfs_mock_backend: public btrfs_backend {
+    public:
+        string name() const override { return "mock"; }
+        int create_snapshot( string source, string dest, bool read_only ) override;
+        int delete_snapshot( string path ) override;
+        long pending_deletions( string path ) override { (void)path; return 0; }
+        int get_subvolume_info( string path, subvolume_info& info ) override;
+        // every snapshot pins one stream_size, none of it shared
+        int get_qgroup_usage( string path, unsigned long long& referenced,
+                unsigned long long& exclusive ) override;
+        vector<string> send_command( const vector<string>& command ) override;
+        stream_sink* receive_sink( string dir, string name ) override;
+        int sync_paths( const vector<string>& paths ) override;
+        // process-wide, the last section to configure the mock wins
+        std::atomic<unsigned> latency_ms{ 0 };
+        std::atomic<unsigned long long> stream_size{ 1 << 20 };
+    private:
+        void delay() const;
+};
+
+// "ioctl", "cli", "auto" (ioctl with cli fallback) or "mock". NULL if
+// unknown.
+btrfs_backend* get_backend( string name );
+
+// identifies the file system a path lives on. subvolumes of one btrfs have
+// different st_dev, so the btrfs fsid is used where available.
+string fs_identity( string path );
+
+// flushes and commits the file systems the paths live on, each one once and
+// all of them at the same time.
+int sync_filesystems( const vector<string>& paths );
@@ -0,0 +1,146 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+// measures the orchestration overhead of btrfs-snap (listing, parent
+// matching, retention planning, process spawning, cleanup) on the mock
+// backend, so no root and no btrfs are needed. run it before and after a
+// change to catch scaling regressions.
+
+#include "snap.hpp"
+#include "backend.hpp"
+#include "match.hpp"
+#include "retention.hpp"
+#include "proc.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::cout;
+using std::endl;
+
+static void report( string name, size_t n, std::function<void()> run ) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start ).count();
+    cout << std::left << std::setw( 18 ) << name << std::right << std::setw( 8 ) << n
+         << std::fixed << std::setprecision( 3 ) << std::setw( 12 ) << ms
+         << std::setw( 12 ) << (n ? ms * 1000 / n : 0.0) << endl;
+}
+
+// n snapshots one minute apart in dir, newest last
+static vector<string> make_series( btrfs_backend* backend, string dir, size_t n ) {
+    vector<string> paths;
+    string last = "";
+    for (time_t t = time( NULL ) - n * 60; paths.size() < n; t += 60) {
+        char date[64];
+        struct tm local;
+        strftime( date, sizeof(date), "%Y-%m-%d_%H-%M-%S", localtime_r( &t, &local ) );
+        // local names repeat in the hour the clocks are turned back; the
+        // second of each is skipped
+        if (date <= last)
+            continue;
+        last = date;
+        paths.push_back( dir + "h_a_" + date );
+        backend->create_snapshot( "", paths.back(), true );
+    }
+    // backdated, or scan_snapshots refuses to cache a directory that just changed
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { time( NULL ) - 10, 0 } };
+    utimensat( AT_FDCWD, dir.c_str(), times, 0 );
+    return paths;
+}
+
+static int bench( size_t n ) {
+    char tmpl[] = "/tmp/btrfs-snap-bench-XXXXXX";
+    if (!mkdtemp( tmpl )) {
+        ERR( "cannot create a temporary directory." );
+        return EXIT_FAILURE;
+    }
+    string root = string( tmpl ) + "/";
+    string local_dir = root + "local/", remote_dir = root + "remote/";
+    mkdir( local_dir.c_str(), 0755 );
+    mkdir( remote_dir.c_str(), 0755 );
+
+    btrfs_backend* backend = get_backend( "mock" );
+    vector<string> local = make_series( backend, local_dir, n );
+    // the remote holds every other snapshot
+    vector<string> remote;
+    for (size_t i=0; i<n; i+=2)
+        remote.push_back( remote_dir + base_name( local[i] ) );
+    for (auto& path: remote)
+        backend->create_snapshot( "", path, true );
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { time( NULL ) - 10, 0 } };
+    utimensat( AT_FDCWD, remote_dir.c_str(), times, 0 );
+
+    vector<string> listed;
+    report( "list (cold)", n, [&](){ listed = snapshot_paths( local_dir, "h_a_" ); } );
+    report( "list (cached)", n, [&](){ listed = snapshot_paths( local_dir, "h_a_" ); } );
+    if (listed.size() != n)
+        WARN( "listed " << listed.size() << " of " << n << " snapshots." );
+
+    snapshot_setup setup;
+    vector<string> newest_first( local.rbegin(), local.rend() );
+    vector<string> uuids( n );
+    remote_target target;
+    target.dir = remote_dir;
+    report( "subvolume info", n + remote.size(), [&](){
+        subvolume_info info;
+        for (size_t i=0; i<n; ++i)
+            if (backend->get_subvolume_info( newest_first[i], info ) == 0)
+                uuids[i] = info.uuid;
+        for (auto& path: remote)
+            if (backend->get_subvolume_info( path, info ) == 0)
+                target.snapshots.push_back( { base_name( path ), info.received_uuid } );
+    } );
+    report( "match parents", n, [&](){
+        mark_candidates( setup, newest_first, uuids, target );
+    } );
+
+    vector<string> expired;
+    retention_policy policy;
+    policy.keep_last = 10;
+    policy.hourly = 24;
+    policy.daily = 7;
+    report( "plan retention", n, [&](){
+        expired = plan_retention( local, policy, { base_name( local.back() ) } );
+    } );
+
+    size_t spawns = std::min( n, (size_t)1000 );
+    report( "spawn process", spawns, [&](){
+        for (size_t i=0; i<spawns; ++i)
+            wait_process( spawn_process( { "true" }, -1, -1, -1 ) );
+    } );
+
+    report( "delete", expired.size(), [&](){ backend->delete_snapshots( expired ); } );
+
+    backend->delete_snapshots( snapshot_paths( local_dir, "h_a_" ) );
+    backend->delete_snapshots( remote );
+    rmdir( local_dir.c_str() );
+    rmdir( remote_dir.c_str() );
+    rmdir( root.c_str() );
+    return EXIT_SUCCESS;
+}
+
+int main( int argc, char** argv ) {
+    vector<size_t> sizes = { 10, 1000, 100000 };
+    if (argc > 1) {
+        sizes.clear();
+        for (int i=1; i<argc; ++i)
+            sizes.push_back( std::stoul( argv[i] ) );
+    }
+    cout << std::left << std::setw( 18 ) << "benchmark" << std::right << std::setw( 8 ) << "n"
+         << std::setw( 12 ) << "ms" << std::setw( 12 ) << "us/item" << endl;
+    for (size_t n: sizes)
+        if (bench( n ))
+            return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
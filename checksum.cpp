@@ -0,0 +1,58 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "checksum.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u // reflected
+
+static uint32_t table_crc32c( uint32_t crc, const unsigned char* p, size_t len ) {
+    static uint32_t table[256];
+    static bool initialized = [](){
+        for (uint32_t i=0; i<256; ++i) {
+            uint32_t c = i;
+            for (int k=0; k<8; ++k)
+                c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)initialized;
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t sse42_crc32c( uint32_t crc, const unsigned char* p, size_t len ) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy( &word, p, sizeof(word) );
+        c = _mm_crc32_u64( c, word );
+    }
+    uint32_t c32 = c;
+    for (; len; ++p, --len)
+        c32 = _mm_crc32_u8( c32, *p );
+    return c32;
+}
+#endif
+
+uint32_t crc32c( uint32_t crc, const void* data, size_t len ) {
+    const unsigned char* p = static_cast<const unsigned char*>( data );
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports( "sse4.2" );
+    if (hardware)
+        return ~sse42_crc32c( crc, p, len );
+#endif
+    return ~table_crc32c( crc, p, len );
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// crc32c (castagnoli polynomial, as used by btrfs and iscsi) of len bytes
+// at data, continuing from crc (0 to start a new one). uses the sse4.2
+// crc32 instruction where the cpu has it and a table otherwise.
+uint32_t crc32c( uint32_t crc, const void* data, size_t len );
@@ -0,0 +1,152 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "cleanup.hpp"
+#include "backend.hpp"
+#include "metrics.hpp"
+#include "throttle.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <chrono>
+
+#define CLEANER_POLL_MS 1000
+
+struct cleanup_batch {
+    string tag;
+    section_metrics* metrics; // of the section that queued the batch
+    thread_priorities priorities; // of the thread that queued it
+    btrfs_backend* backend;
+    long max_pending;
+    vector<string> paths;
+};
+
+static std::mutex queue_mutex;
+static std::condition_variable queue_changed;
+static std::deque<cleanup_batch> queue;
+static std::thread* worker = NULL;
+static bool worker_exit = false;
+static bool failed = false;
+
+static string parent_dir( string path ) {
+    while (path.size() > 1 && path.back() == '/')
+        path.pop_back();
+    size_t pos = path.rfind( '/' );
+    return pos == string::npos ? "." : path.substr( 0, pos ? pos : 1 );
+}
+
+static int delete_throttled( const cleanup_batch& batch ) {
+    btrfs_backend* backend = batch.backend;
+    if (backend->pending_deletions( parent_dir( batch.paths[0] ) ) < 0)
+        return backend->delete_snapshots( batch.paths );
+
+    int result = EXIT_SUCCESS;
+    for (auto& path: batch.paths) {
+        string dir = parent_dir( path );
+        bool waited = false;
+        long pending;
+        while ((pending = backend->pending_deletions( dir )) > batch.max_pending) {
+            if (!waited)
+                INFO( pending << " deleted subvolumes not cleaned yet on '" << dir << "', waiting..." );
+            waited = true;
+            std::this_thread::sleep_for( std::chrono::milliseconds( CLEANER_POLL_MS ) );
+        }
+        if (backend->delete_snapshot( path ))
+            result = EXIT_FAILURE;
+    }
+    return result;
+}
+
+static void worker_loop() {
+    std::unique_lock<std::mutex> lock( queue_mutex );
+    for (;;) {
+        queue_changed.wait( lock, [](){ return !queue.empty() || worker_exit; } );
+        if (queue.empty())
+            break;
+        cleanup_batch batch = queue.front();
+        lock.unlock();
+        log_tag = batch.tag;
+        current_metrics = batch.metrics;
+        // the worker serves all sections, so each batch runs with the io
+        // priority and nice value of the section that queued it
+        set_priorities( batch.priorities );
+        phase_timer timer( "delete" );
+        int result = delete_throttled( batch );
+        timer.stop();
+        if (result)
+            record_cleanup_failure();
+        current_metrics = NULL;
+        INFO( "background cleanup of " << batch.paths.size() << " snapshots done" <<
+                (result ? " with errors." : ".") );
+        lock.lock();
+        queue.pop_front();
+        if (result)
+            failed = true;
+        queue_changed.notify_all();
+    }
+}
+
+int cleanup_snapshots( const snapshot_setup& setup, const vector<string>& paths, btrfs_backend* backend ) {
+    if (paths.empty())
+        return EXIT_SUCCESS;
+    if (!backend)
+        backend = get_backend( setup.backend );
+    if (!setup.async_cleanup)
+        return backend->delete_snapshots( paths );
+
+    std::lock_guard<std::mutex> lock( queue_mutex );
+    queue.push_back( { log_tag, current_metrics, current_priorities(), backend,
+            (long)setup.cleaner_max_pending, paths } );
+    if (!worker) {
+        worker_exit = false;
+        worker = new std::thread( worker_loop );
+    }
+    queue_changed.notify_all();
+    return EXIT_SUCCESS;
+}
+
+void cleanup_wait_for( const vector<string>& dirs ) {
+    std::set<string> waiting;
+    for (string dir: dirs) {
+        while (dir.size() > 1 && dir.back() == '/')
+            dir.pop_back();
+        waiting.insert( dir );
+    }
+    // a batch stays queued until it is done
+    auto queued = [&](){
+        for (auto& batch: queue)
+            for (auto& path: batch.paths)
+                if (waiting.count( parent_dir( path ) ))
+                    return true;
+        return false;
+    };
+    std::unique_lock<std::mutex> lock( queue_mutex );
+    if (!queued())
+        return;
+    INFO( "waiting for queued deletions in the snapshot directories..." );
+    queue_changed.wait( lock, [&](){ return !queued(); } );
+}
+
+int cleanup_wait() {
+    std::thread* t;
+    {
+        std::lock_guard<std::mutex> lock( queue_mutex );
+        t = worker;
+        worker = NULL;
+        worker_exit = true;
+        queue_changed.notify_all();
+    }
+    if (t) {
+        t->join();
+        delete t;
+    }
+    std::lock_guard<std::mutex> lock( queue_mutex );
+    int result = failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    failed = false;
+    return result;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "snap.hpp"
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+class btrfs_backend;
+
+// deletes paths with backend (NULL: the one of setup). with setup.async_cleanup the
+// batch is queued for a background thread and the call returns at once;
+// that thread holds back while the btrfs cleaner of the target file system
+// has more than setup.cleaner_max_pending deleted subvolumes to process,
+// and deletes with the io priority and nice value of the calling thread.
+int cleanup_snapshots( const snapshot_setup& setup, const vector<string>& paths,
+        btrfs_backend* backend = NULL );
+
+// waits until the queued deletions in dirs are done, so a listing of them
+// does not show snapshots that are about to go.
+void cleanup_wait_for( const vector<string>& dirs );
+
+// waits until all queued deletions are done. returns EXIT_FAILURE if any of
+// them failed since the last call.
+int cleanup_wait();
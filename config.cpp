@@ -2,6 +2,7 @@
 #include "snap.hpp"
 
 #include <iostream>
+#include <stdexcept>
 #include <boost/property_tree/exceptions.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/ini_parser.hpp>
@@ -36,36 +37,166 @@ static bool parse_bool( string s ) {
     return false;
 }
 
-void set_params( const vector<pair<string,string>>& params ) {
+size_t parse_size( string s ) {
+    size_t pos = 0;
+    unsigned long long value = std::stoull( s, &pos );
+    string suffix = s.substr( pos );
+    if (suffix == "" || suffix == "B")
+        return value;
+    if (suffix == "K" || suffix == "KiB")
+        return value << 10;
+    if (suffix == "M" || suffix == "MiB")
+        return value << 20;
+    if (suffix == "G" || suffix == "GiB")
+        return value << 30;
+    WARN( "'" << s << "' not a size. assume bytes." );
+    return value;
+}
+
+// durations like "30s", "15m", "1h" or "7d". plain numbers are seconds.
+static unsigned parse_duration( string s ) {
+    size_t pos = 0;
+    unsigned long value = std::stoul( s, &pos );
+    string suffix = s.substr( pos );
+    if (suffix == "" || suffix == "s")
+        return value;
+    if (suffix == "m")
+        return value * 60;
+    if (suffix == "h")
+        return value * 60 * 60;
+    if (suffix == "d")
+        return value * 24 * 60 * 60;
+    WARN( "'" << s << "' not a duration. assume seconds." );
+    return value;
+}
+
+// throws std::invalid_argument or std::out_of_range for a number that does
+// not parse
+static void set_param( snapshot_setup& setup, const pair<string,string>& p ) {
+    if (p.first == "host_name") {
+        setup.host_name = p.second;
+    } else if (p.first == "backup_name") {
+        setup.backup_name = p.second;
+    } else if (p.first == "backup_dir") {
+        setup.backup_dir = p.second;
+    } else if (p.first == "snapshot_dir") {
+        setup.snapshot_dir = p.second;
+    } else if (p.first == "remote_snapshot_dir") {
+        setup.remote_snapshot_dir = p.second;
+    } else if (p.first == "keep_remote_snapshots_num") {
+        setup.keep_remote_snapshots_num = std::stoi(p.second);
+    } else if (p.first == "keep_snapshots_num") {
+        setup.keep_snapshots_num = std::stoi(p.second);
+    } else if (p.first == "dry_run") {
+        setup.dry_run = parse_bool(p.second);
+    } else if (p.first == "pre_command") {
+        setup.pre_command = p.second;
+    } else if (p.first == "post_command") {
+        setup.post_command = p.second;
+    } else if (p.first == "transfer") {
+        setup.transfer = parse_bool(p.second);
+    } else if (p.first == "create") {
+        setup.create = parse_bool(p.second);
+    } else if (p.first == "skip_unchanged") {
+        setup.skip_unchanged = parse_bool(p.second);
+    } else if (p.first == "sync") {
+        setup.do_sync = parse_bool(p.second);
+    } else if (p.first == "buffer_size") {
+        setup.buffer_size = parse_size(p.second);
+    } else if (p.first == "progress_interval") {
+        setup.progress_interval = std::stoi(p.second);
+    } else if (p.first == "backend") {
+        setup.backend = p.second;
+    } else if (p.first == "async_cleanup") {
+        setup.async_cleanup = parse_bool(p.second);
+    } else if (p.first == "cleaner_max_pending") {
+        setup.cleaner_max_pending = std::stoi(p.second);
+    } else if (p.first == "compressed_data") {
+        if (p.second == "auto")
+            setup.compressed_data = "auto";
+        else
+            setup.compressed_data = parse_bool(p.second) ? "true" : "false";
+    } else if (p.first == "target") {
+        setup.target = p.second;
+    } else if (p.first == "archive_chunk_size") {
+        setup.archive_chunk_size = parse_size(p.second);
+    } else if (p.first == "archive_compression_level") {
+        setup.archive_compression_level = std::stoi(p.second);
+    } else if (p.first == "archive_threads") {
+        setup.archive_threads = std::stoi(p.second);
+    } else if (p.first == "archive_full_every") {
+        setup.archive_full_every = std::stoi(p.second);
+    } else if (p.first == "transfer_chain") {
+        setup.transfer_chain = parse_bool(p.second);
+    } else if (p.first == "io_class") {
+        setup.io_class = p.second;
+    } else if (p.first == "io_level") {
+        setup.io_level = std::stoi(p.second);
+    } else if (p.first == "nice") {
+        setup.nice = std::stoi(p.second);
+    } else if (p.first == "bandwidth_limit") {
+        setup.bandwidth_limit = parse_size(p.second);
+    } else if (p.first == "bandwidth_schedule") {
+        setup.bandwidth_schedule = p.second;
+    } else if (p.first == "interval") {
+        setup.interval = parse_duration(p.second);
+    } else if (p.first == "interval_offset") {
+        setup.interval_offset = parse_duration(p.second);
+    } else if (p.first == "parent_probes") {
+        setup.parent_probes = std::stoi(p.second);
+    } else if (p.first == "clone_sources") {
+        setup.clone_sources = std::stoi(p.second);
+    } else if (p.first == "keep_hourly") {
+        setup.keep_hourly = std::stoi(p.second);
+    } else if (p.first == "keep_daily") {
+        setup.keep_daily = std::stoi(p.second);
+    } else if (p.first == "keep_weekly") {
+        setup.keep_weekly = std::stoi(p.second);
+    } else if (p.first == "keep_monthly") {
+        setup.keep_monthly = std::stoi(p.second);
+    } else if (p.first == "keep_remote_hourly") {
+        setup.keep_remote_hourly = std::stoi(p.second);
+    } else if (p.first == "keep_remote_daily") {
+        setup.keep_remote_daily = std::stoi(p.second);
+    } else if (p.first == "keep_remote_weekly") {
+        setup.keep_remote_weekly = std::stoi(p.second);
+    } else if (p.first == "keep_remote_monthly") {
+        setup.keep_remote_monthly = std::stoi(p.second);
+    } else if (p.first == "max_deletions") {
+        setup.max_deletions = std::stoi(p.second);
+    } else if (p.first == "max_deleted_bytes") {
+        setup.max_deleted_bytes = parse_size(p.second);
+    } else if (p.first == "space_budget") {
+        setup.space_budget = parse_size(p.second);
+    } else if (p.first == "remote_space_budget") {
+        setup.remote_space_budget = parse_size(p.second);
+    } else if (p.first == "mock_latency") {
+        setup.mock_latency = std::stoi(p.second);
+    } else if (p.first == "mock_stream_size") {
+        setup.mock_stream_size = parse_size(p.second);
+    } else if (p.first == "transport") {
+        setup.transport = p.second;
+    } else if (p.first == "transport_compression") {
+        setup.transport_compression = p.second;
+    } else if (p.first == "transport_compression_level") {
+        setup.transport_compression_level = std::stoi(p.second);
+    } else if (p.first == "checksum") {
+        setup.checksum = parse_bool(p.second);
+    } else if (p.first == "verify_interval") {
+        setup.verify_interval = parse_duration(p.second);
+    } else {
+        WARN( "key '" << p.first << "' unknown." );
+    }
+}
+
+int set_params( snapshot_setup& setup, const vector<pair<string,string>>& params ) {
     for (auto& p: params) {
-        if (p.first == "host_name") {
-            snapshot_setup::host_name = p.second;
-        } else if (p.first == "backup_name") {
-            snapshot_setup::backup_name = p.second;
-        } else if (p.first == "backup_dir") {
-            snapshot_setup::backup_dir = p.second;
-        } else if (p.first == "snapshot_dir") {
-            snapshot_setup::snapshot_dir = p.second;
-        } else if (p.first == "remote_snapshot_dir") {
-            snapshot_setup::remote_snapshot_dir = p.second;
-        } else if (p.first == "keep_remote_snapshots_num") {
-            snapshot_setup::keep_remote_snapshots_num = std::stoi(p.second);
-        } else if (p.first == "keep_snapshots_num") {
-            snapshot_setup::keep_snapshots_num = std::stoi(p.second);
-        } else if (p.first == "dry_run") {
-            snapshot_setup::dry_run = parse_bool(p.second);
-        } else if (p.first == "pre_command") {
-            snapshot_setup::pre_command = p.second;
-        } else if (p.first == "post_command") {
-            snapshot_setup::post_command = p.second;
-        } else if (p.first == "transfer") {
-            snapshot_setup::transfer = parse_bool(p.second);
-        } else if (p.first == "create") {
-            snapshot_setup::create = parse_bool(p.second);
-        } else if (p.first == "sync") {
-            snapshot_setup::do_sync = parse_bool(p.second);
-        } else {
-            WARN( "key '" << p.first << "' unknown." );
+        try {
+            set_param( setup, p );
+        } catch (const std::logic_error&) {
+            ERR( "'" << p.second << "' is no valid value for '" << p.first << "'." );
+            return EXIT_FAILURE;
         }
     }
+    return EXIT_SUCCESS;
 }
@@ -1,3 +1,7 @@
+#pragma once
+
+#include "snap.hpp"
+
 #include <string>
 #include <vector>
 #include <utility>
@@ -8,4 +12,8 @@ using std::pair;
 
 int parse_config( string fname, vector<vector<pair<string,string>>>& config,
         vector<string>& sections );
-void set_params( const vector<pair<string,string>>& params );
+// sizes like "512K", "256M" or "1G". plain numbers are bytes.
+size_t parse_size( string s );
+// EXIT_FAILURE (logged) if a value cannot be read, e.g. a number that does
+// not parse
+int set_params( snapshot_setup& setup, const vector<pair<string,string>>& params );
@@ -0,0 +1,209 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "daemon.hpp"
+#include "config.hpp"
+#include "sched.hpp"
+#include "cleanup.hpp"
+#include "metrics.hpp"
+#include "nokill.hpp"
+
+#include <map>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+
+struct scheduled_section {
+    string name;
+    snapshot_setup setup;
+    time_t next = 0;
+};
+
+static string format_time( time_t t ) {
+    struct tm local;
+    localtime_r( &t, &local );
+    char buf[64];
+    strftime( buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local );
+    return buf;
+}
+
+// intervals of up to a day are aligned to local midnight plus
+// interval_offset (1h runs at the full hour, 1d with a 2h offset nightly at
+// two); longer ones count from the last run.
+static time_t next_run( const snapshot_setup& setup, time_t after, time_t last ) {
+    const time_t day = 24*60*60;
+    time_t interval = setup.interval;
+    if (interval > day)
+        return last ? last + interval : after;
+    struct tm local;
+    localtime_r( &after, &local );
+    local.tm_hour = local.tm_min = local.tm_sec = 0;
+    local.tm_isdst = -1;
+    time_t start = mktime( &local ) + (time_t)setup.interval_offset % interval - interval;
+    return start + ((after - start) / interval + 1) * interval;
+}
+
+static int load_sections( string config_file, const snapshot_setup& defaults,
+        vector<scheduled_section>& sections ) {
+    vector<vector<pair<string,string>>> config;
+    vector<string> names;
+    if (parse_config( config_file, config, names ))
+        return EXIT_FAILURE;
+    sections.clear();
+    // a section starts from the settings of the one before it, as in
+    // config file mode
+    snapshot_setup setup = defaults;
+    for (size_t i=0; i<names.size(); ++i) {
+        scheduled_section section;
+        section.name = names[i];
+        if (set_params( setup, config[i] )) {
+            ERR( "cannot read section [" << names[i] << "] of '" << config_file << "'." );
+            return EXIT_FAILURE;
+        }
+        section.setup = setup;
+        if (!section.setup.interval) {
+            WARN( "[" << names[i] << "] has no interval, not scheduled." );
+            continue;
+        }
+        sections.push_back( section );
+    }
+    if (sections.empty())
+        WARN( "no section of '" << config_file << "' is scheduled." );
+    return EXIT_SUCCESS;
+}
+
+int run_daemon( string config_file, const snapshot_setup& defaults, unsigned max_parallel,
+        bool two_phase, string report_file, string textfile ) {
+    vector<scheduled_section> sections;
+    if (load_sections( config_file, defaults, sections ))
+        return EXIT_FAILURE;
+
+    // editors replace the file instead of writing it, so the directory is
+    // watched
+    string config_dir = config_file.find( '/' ) == string::npos ? "." :
+        config_file.substr( 0, config_file.rfind( '/' ) + 1 );
+    string config_name = config_file.substr( config_file.rfind( '/' ) + 1 );
+    int notify = inotify_init1( IN_CLOEXEC | IN_NONBLOCK );
+    if (notify < 0 || inotify_add_watch( notify, config_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO ) < 0) {
+        ERR( "cannot watch '" << config_dir << "': " << strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    // a clock change cancels the timer, so the schedule is recomputed
+    int timer = timerfd_create( CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK );
+    if (timer < 0) {
+        ERR( "cannot create timer: " << strerror( errno ) );
+        close( notify );
+        return EXIT_FAILURE;
+    }
+
+    std::map<string, time_t> last_run;
+    std::map<string, section_metrics> report;
+    bool reschedule = true;
+    CFG( "daemon mode, " << sections.size() << " scheduled section(s)." );
+    for (;;) {
+        time_t now = time( NULL );
+        if (reschedule) {
+            for (auto& section: sections) {
+                section.next = next_run( section.setup, now, last_run[section.name] );
+                CFG( "[" << section.name << "] next run " << format_time( section.next ) );
+            }
+            reschedule = false;
+        }
+
+        vector<snap_job> jobs;
+        time_t next = LONG_MAX;
+        for (auto& section: sections) {
+            if (section.next <= now)
+                jobs.emplace_back( section.name, section.setup );
+            else
+                next = std::min( next, section.next );
+        }
+        if (!jobs.empty()) {
+            if (two_phase)
+                run_jobs_two_phase( jobs, max_parallel );
+            else
+                run_jobs( jobs, max_parallel );
+            cleanup_wait();
+            snap_finalize_sync( defaults );
+            for (auto& job: jobs) {
+                last_run[job.name] = now;
+                if (job.metrics.started)
+                    report[job.name] = job.metrics;
+            }
+            vector<section_metrics> metrics;
+            for (auto& r: report)
+                metrics.push_back( r.second );
+            write_run_report( metrics, report_file, textfile );
+            if (nokill_cancelled())
+                break;
+            for (auto& section: sections) {
+                if (section.next <= now) {
+                    section.next = next_run( section.setup, time( NULL ), now );
+                    CFG( "[" << section.name << "] next run " << format_time( section.next ) );
+                }
+            }
+            continue;
+        }
+
+        struct itimerspec spec = {};
+        spec.it_value.tv_sec = next == LONG_MAX ? 0 : next;
+        if (timerfd_settime( timer, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL )) {
+            ERR( "cannot set timer: " << strerror( errno ) );
+            break;
+        }
+        struct pollfd fds[3] = { { timer, POLLIN, 0 }, { notify, POLLIN, 0 }, { nokill_fd(), POLLIN, 0 } };
+        if (poll( fds, 3, -1 ) < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR( "poll failed: " << strerror( errno ) );
+            break;
+        }
+        if (fds[2].revents) {
+            // nothing is running, so this is an orderly stop
+            CFG( "stopped." );
+            close( timer );
+            close( notify );
+            return EXIT_SUCCESS;
+        }
+        if (fds[0].revents) {
+            uint64_t expirations;
+            if (read( timer, &expirations, sizeof(expirations) ) < 0 && errno == ECANCELED) {
+                CFG( "clock changed, rescheduling." );
+                reschedule = true;
+            }
+        }
+        if (fds[1].revents) {
+            bool changed = false;
+            alignas(struct inotify_event) char buf[4096];
+            ssize_t n;
+            while ((n = read( notify, buf, sizeof(buf) )) > 0) {
+                for (char* p = buf; p < buf + n; ) {
+                    struct inotify_event* event = (struct inotify_event*)p;
+                    if (event->len && config_name == event->name)
+                        changed = true;
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            if (changed) {
+                CFG( "'" << config_file << "' changed, reloading." );
+                vector<scheduled_section> reloaded;
+                if (load_sections( config_file, defaults, reloaded )) {
+                    ERR( "keeping the previous configuration." );
+                } else {
+                    sections = reloaded;
+                    reschedule = true;
+                }
+            }
+        }
+    }
+    close( timer );
+    close( notify );
+    return EXIT_FAILURE;
+}
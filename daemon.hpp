@@ -0,0 +1,16 @@
+#pragma once
+
+#include "snap.hpp"
+
+#include <string>
+
+using std::string;
+
+// stays resident and runs every section of config_file on its own
+// interval (see snapshot_setup::interval) from a timerfd loop. the config
+// file is watched with inotify and reloaded when it is rewritten; a broken
+// new version keeps the old one in place. sections start from defaults like
+// in config file mode; with two_phase the sections due at the same time
+// are run with run_jobs_two_phase(). only returns on errors.
+int run_daemon( string config_file, const snapshot_setup& defaults, unsigned max_parallel,
+        bool two_phase, string report_file, string textfile );
@@ -0,0 +1,71 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "fileio.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+int read_whole_file( string path, string& contents ) {
+    contents.clear();
+    int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    if (fd < 0)
+        return EXIT_FAILURE;
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read( fd, buf, sizeof(buf) )) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        contents.append( buf, n );
+    }
+    int error = errno;
+    close( fd );
+    errno = error;
+    return n < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int write_whole_file( string path, const string& contents, mode_t mode ) {
+    int fd = open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode );
+    if (fd < 0)
+        return EXIT_FAILURE;
+    const char* p = contents.data();
+    size_t len = contents.size();
+    while (len) {
+        ssize_t n = write( fd, p, len );
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            int error = errno;
+            close( fd );
+            errno = error;
+            return EXIT_FAILURE;
+        }
+        p += n;
+        len -= n;
+    }
+    int result = fsync( fd ) ? EXIT_FAILURE : EXIT_SUCCESS;
+    int error = errno;
+    if (close( fd ) && !result) {
+        result = EXIT_FAILURE;
+        error = errno;
+    }
+    errno = error;
+    return result;
+}
+
+int replace_file( string path, const string& contents, mode_t mode ) {
+    string tmp = path + ".tmp";
+    if (write_whole_file( tmp, contents, mode ) || rename( tmp.c_str(), path.c_str() )) {
+        int error = errno;
+        unlink( tmp.c_str() );
+        errno = error;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
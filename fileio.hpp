@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <sys/types.h>
+
+using std::string;
+
+// the whole file at path. EXIT_FAILURE with errno set if it cannot be read.
+int read_whole_file( string path, string& contents );
+
+// creates or truncates path and writes contents, fsynced before it returns.
+int write_whole_file( string path, const string& contents, mode_t mode = 0644 );
+
+// replaces path atomically: contents are written and fsynced to path.tmp,
+// which is then renamed over it, so readers see the old or the new file.
+// errno tells why it failed.
+int replace_file( string path, const string& contents, mode_t mode = 0644 );
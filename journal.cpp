@@ -0,0 +1,65 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "journal.hpp"
+#include "snap.hpp"
+#include "fileio.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+string journal_path( string snapshot_dir, string prefix ) {
+    while (snapshot_dir.size() > 1 && snapshot_dir.back() == '/')
+        snapshot_dir.pop_back();
+    while (prefix.size() && prefix.back() == '_')
+        prefix.pop_back();
+    return snapshot_dir + "/.btrfs-snap-journal-" + prefix;
+}
+
+vector<journal_step> read_journal( string path ) {
+    vector<journal_step> steps;
+    std::ifstream in( path );
+    for (string line; std::getline( in, line ); ) {
+        std::istringstream fields( line );
+        journal_step step;
+        if (std::getline( fields, step.target, '\t' ) && std::getline( fields, step.parent, '\t' ) &&
+                std::getline( fields, step.name, '\t' ) && step.name != "")
+            steps.push_back( step );
+        else if (line != "")
+            WARN( "ignoring malformed line in journal '" << path << "'." );
+    }
+    return steps;
+}
+
+int update_journal( string path, const vector<string>& targets, const vector<journal_step>& steps ) {
+    vector<journal_step> all = read_journal( path );
+    all.erase( std::remove_if( all.begin(), all.end(), [&]( const journal_step& step ){
+                return std::find( targets.begin(), targets.end(), step.target ) != targets.end(); } ),
+            all.end() );
+    all.insert( all.end(), steps.begin(), steps.end() );
+
+    if (all.empty()) {
+        if (unlink( path.c_str() ) && errno != ENOENT) {
+            ERR( "cannot remove journal '" << path << "': " << strerror( errno ) );
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    std::ostringstream out;
+    for (auto& step: all)
+        out << step.target << "\t" << step.parent << "\t" << step.name << "\n";
+    if (replace_file( path, out.str(), 0600 )) {
+        ERR( "cannot write journal '" << path << "': " << strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+// transfers that are planned but not finished yet. the journal lives in the
+// snapshot dir, so an interrupted run leaves a record of which subvolume was
+// being received and which local snapshots the remaining steps need.
+struct journal_step {
+    string target; // remote snapshot directory
+    string parent; // empty for a full send
+    string name;
+};
+
+// journal of the snapshot series prefix in snapshot_dir
+string journal_path( string snapshot_dir, string prefix );
+
+// pending steps in the order they were planned, empty if there is no journal
+vector<journal_step> read_journal( string path );
+
+// replaces the steps of the given targets by steps (dropping them if steps
+// has none for a target) and writes the journal atomically. an empty
+// journal is removed.
+int update_journal( string path, const vector<string>& targets, const vector<journal_step>& steps );
@@ -9,7 +9,13 @@
 
 #include "snap.hpp"
 #include "config.hpp"
+#include "sched.hpp"
+#include "cleanup.hpp"
 #include "nokill.hpp"
+#include "transfer.hpp"
+#include "archive.hpp"
+#include "metrics.hpp"
+#include "daemon.hpp"
 #include <unistd.h>
 
 void print_help( string progname ) {
@@ -30,60 +36,90 @@ void print_help( string progname ) {
          << "         -x <cmd>        execute <cmd> after snapshooting" << endl
          << "         -C              do not create a snapshot" << endl
          << "         -d              dry run (only print commands)" << endl
-         << "         -c <file>       run from config file" << endl;
+         << "         -c <file>       run from config file" << endl
+         << "         -j <num>        run at most <num> config sections at once" << endl
+         << "         -A              snapshot all config sections first, then transfer" << endl
+         << "         -D              stay resident and run the config sections on their intervals" << endl
+         << "         -X <archive>    restore <archive> and missing parents into the snapshot dir" << endl
+         << "         -J <file>       write a JSON report with per-phase timings to <file>" << endl
+         << "         -N <file>       write the timings as node_exporter textfile to <file>" << endl;
 }
 
 int main( int argc, char** argv ) {
     int opt;
     string setup_variables = "";
     string config_file = DEFAULT_CONFIG_FILE;
-    while ((opt = getopt(argc, argv, ":hdR:S:r:s:b:B:p:H:TP:Cc:x:")) != -1) {
+    unsigned max_parallel = 0;
+    string restore_archive = "";
+    string report_file = "", textfile = "";
+    bool daemon_mode = false;
+    bool two_phase = false;
+    snapshot_setup setup;
+    while ((opt = getopt(argc, argv, ":hdR:S:r:s:b:B:p:H:TP:Cc:x:j:X:J:N:DA")) != -1) {
         switch (opt) {
             case 'h':
                 print_help( argv[0] );
                 return EXIT_SUCCESS;
             case 'R':
-                snapshot_setup::remote_snapshot_dir = string(optarg);
+                setup.remote_snapshot_dir = string(optarg);
                 break;
             case 'S':
-                snapshot_setup::snapshot_dir = string(optarg);
+                setup.snapshot_dir = string(optarg);
                 break;
             case 'r':
-                snapshot_setup::keep_remote_snapshots_num = atoi(optarg);
+                setup.keep_remote_snapshots_num = atoi(optarg);
                 break;
             case 's':
-                snapshot_setup::keep_snapshots_num = atoi(optarg);
+                setup.keep_snapshots_num = atoi(optarg);
                 break;
             case 'b':
-                snapshot_setup::backup_dir = string(optarg);
+                setup.backup_dir = string(optarg);
                 break;
             case 'B':
-                snapshot_setup::backup_name = string(optarg);
+                setup.backup_name = string(optarg);
                 break;
             case 'p':
                 setup_variables = string(optarg);
                 break;
             case 'H':
-                snapshot_setup::host_name = string(optarg);
+                setup.host_name = string(optarg);
                 break;
             case 'd':
-                snapshot_setup::dry_run = true;
+                setup.dry_run = true;
                 break;
             case 'T':
-                snapshot_setup::transfer = false;
+                setup.transfer = false;
                 break;
             case 'P':
-                snapshot_setup::pre_command = string(optarg);
+                setup.pre_command = string(optarg);
                 break;
             case 'x':
-                snapshot_setup::post_command = string(optarg);
+                setup.post_command = string(optarg);
                 break;
             case 'C':
-                snapshot_setup::create = false;
+                setup.create = false;
                 break;
             case 'c':
                 config_file = string(optarg);
                 break;
+            case 'j':
+                max_parallel = atoi(optarg);
+                break;
+            case 'X':
+                restore_archive = string(optarg);
+                break;
+            case 'D':
+                daemon_mode = true;
+                break;
+            case 'A':
+                two_phase = true;
+                break;
+            case 'J':
+                report_file = string(optarg);
+                break;
+            case 'N':
+                textfile = string(optarg);
+                break;
             case '?':
                 WARN( "unknown option '-" << (char)optopt << "'. show help with -h" );
                 break;
@@ -93,6 +129,22 @@ int main( int argc, char** argv ) {
     }
     nokill_init();
 
+    if (restore_archive != "")
+        return archive_restore( restore_archive, setup.snapshot_dir, setup.archive_threads, setup.dry_run );
+
+    const send_features& features = detect_send_features();
+    CFG( "send stream: kernel v" << features.kernel_stream_version << ", btrfs-progs " <<
+            (features.progs_compressed_data ? "with" : "without") << " --compressed-data, using protocol " <<
+            (features.compressed_data() ? "v2 with compressed data" : "v1") << " where not configured." );
+
+    if (daemon_mode) {
+        if (config_file == "") {
+            ERR( "daemon mode needs a config file." );
+            return EXIT_FAILURE;
+        }
+        return run_daemon( config_file, setup, max_parallel, two_phase, report_file, textfile );
+    }
+
     if (config_file != "") {
         vector<vector<pair<string,string>>> config;
         vector<string> sections;
@@ -100,28 +152,50 @@ int main( int argc, char** argv ) {
             return EXIT_FAILURE;
         if (sections.size() > 0) {
             CFG( "config file mode." );
+            vector<snap_job> jobs;
+            bool finalize_sync = false;
+            // a section starts from the settings of the one before it
+            snapshot_setup section_setup = setup;
             for (unsigned i=0; i<sections.size(); ++i) {
                 CFG( "[" << sections[i] << "]" );
-                set_params( config[i] );
-                if (snap_and_transfer())
+                if (set_params( section_setup, config[i] ))
                     return EXIT_FAILURE;
+                if (!section_setup.do_sync)
+                    finalize_sync = true;
+                jobs.emplace_back( sections[i], section_setup );
             }
-            if (!snapshot_setup::do_sync)
-                if (snap_finalize_sync())
+            int result = two_phase ? run_jobs_two_phase( jobs, max_parallel ) :
+                run_jobs( jobs, max_parallel );
+            // the report includes the background deletions
+            if (cleanup_wait())
+                result = EXIT_FAILURE;
+            vector<section_metrics> report;
+            for (auto& job: jobs)
+                if (job.metrics.started)
+                    report.push_back( job.metrics );
+            if (write_run_report( report, report_file, textfile ) || result)
+                return EXIT_FAILURE;
+            if (finalize_sync)
+                if (snap_finalize_sync( setup ))
                     return EXIT_FAILURE;
             return EXIT_SUCCESS;
         }
     }
 
     if (setup_variables != "")
-        if (setup_variables_saved( setup_variables ))
+        if (setup_variables_saved( setup, setup_variables ))
             return EXIT_FAILURE;
 
-    if (snap_and_transfer())
+    section_metrics metrics;
+    int result = measured_run( setup.host_name + "_" + setup.backup_name, metrics,
+            [&](){ return snap_and_transfer( setup ); } );
+    if (cleanup_wait())
+        result = EXIT_FAILURE;
+    if (write_run_report( { metrics }, report_file, textfile ) || result)
         return EXIT_FAILURE;
 
-    if (!snapshot_setup::do_sync)
-        if (snap_finalize_sync())
+    if (!setup.do_sync)
+        if (snap_finalize_sync( setup ))
             return EXIT_FAILURE;
 
     nokill_clear();
@@ -0,0 +1,39 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "match.hpp"
+
+#include <algorithm>
+
+void mark_candidates( const snapshot_setup& setup, const vector<string>& local_snapshots,
+        const vector<string>& local_uuids, remote_target& target ) {
+    bool by_name = std::all_of( local_uuids.begin(), local_uuids.end(),
+            []( const string& uuid ){ return uuid == ""; } );
+    std::unordered_map<string, size_t> local_index;
+    for (size_t i=0; i<local_snapshots.size(); ++i)
+        local_index.emplace( by_name ? base_name( local_snapshots[i] ) : local_uuids[i], i );
+    target.candidates.assign( local_snapshots.size(), false );
+    for (auto& remote: target.snapshots) {
+        const string& key = by_name ? remote.first : remote.second;
+        auto match = key == "" ? local_index.end() : local_index.find( key );
+        if (match != local_index.end())
+            target.candidates[match->second] = true;
+    }
+
+    if (setup.target != "archive")
+        return;
+    // archives chain up to the last full stream; start a new chain once it
+    // is archive_full_every links long.
+    for (size_t i=0; i<local_snapshots.size(); ++i) {
+        if (!target.candidates[i])
+            continue;
+        unsigned depth = 0;
+        for (string p = base_name( local_snapshots[i] ); p != "" && target.parents.count( p ) &&
+                depth <= setup.archive_full_every; p = target.parents[p])
+            depth++;
+        if (depth >= setup.archive_full_every)
+            target.candidates[i] = false;
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "snap.hpp"
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+
+using std::string;
+using std::vector;
+using std::pair;
+
+// a remote snapshot or archive directory to send to
+struct remote_target {
+    string dir;
+    // (name, received uuid) of the snapshots in dir
+    vector<pair<string,string>> snapshots;
+    // archive name -> parent name, for archive targets
+    std::unordered_map<string,string> parents;
+    // local snapshots (by index) this target can receive an incremental against
+    vector<bool> candidates;
+};
+
+// marks the local snapshots (newest first) the target holds by joining its
+// received uuids on the local uuids. a remote snapshot that merely has the
+// right name (e.g. a partial receive) never counts. without any local uuid
+// (kernel cannot report subvolume info) names are joined instead.
+void mark_candidates( const snapshot_setup& setup, const vector<string>& local_snapshots,
+        const vector<string>& local_uuids, remote_target& target );
@@ -0,0 +1,183 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "metrics.hpp"
+#include "snap.hpp"
+#include "fileio.hpp"
+
+#include <sstream>
+#include <mutex>
+#include <iomanip>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+
+thread_local section_metrics* current_metrics = NULL;
+// phases and failures may be added by the cleanup thread
+static std::mutex metrics_mutex;
+
+phase_timer::phase_timer( string name_ ):
+    name( name_ ), start( std::chrono::steady_clock::now() ) {
+}
+
+void phase_timer::stop() {
+    if (stopped || !current_metrics)
+        return;
+    stopped = true;
+    double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    std::lock_guard<std::mutex> lock( metrics_mutex );
+    for (auto& phase: current_metrics->phases) {
+        if (phase.name == name) {
+            phase.seconds += seconds;
+            phase.bytes += bytes_;
+            return;
+        }
+    }
+    phase_metrics phase;
+    phase.name = name;
+    phase.seconds = seconds;
+    phase.bytes = bytes_;
+    current_metrics->phases.push_back( phase );
+}
+
+void record_cleanup_failure() {
+    if (!current_metrics)
+        return;
+    std::lock_guard<std::mutex> lock( metrics_mutex );
+    current_metrics->cleanup_failed = true;
+}
+
+int measured_run( string section, section_metrics& metrics, std::function<int()> run ) {
+    metrics.section = section;
+    if (!metrics.started)
+        metrics.started = time( NULL );
+    auto start = std::chrono::steady_clock::now();
+    current_metrics = &metrics;
+    metrics.result = run();
+    current_metrics = NULL;
+    metrics.seconds += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    return metrics.result;
+}
+
+static string json_string( const string& s ) {
+    std::ostringstream out;
+    out << '"';
+    for (unsigned char c: s) {
+        if (c == '"' || c == '\\')
+            out << '\\' << c;
+        else if (c == '\n')
+            out << "\\n";
+        else if (c < 0x20)
+            out << "\\u" << std::hex << std::setw( 4 ) << std::setfill( '0' ) << (int)c << std::dec;
+        else
+            out << c;
+    }
+    out << '"';
+    return out.str();
+}
+
+static string label_value( const string& s ) {
+    string out;
+    for (char c: s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c == '\n' ? string( "\\n" ) : string( 1, c );
+    }
+    return out;
+}
+
+static string format_json( const vector<section_metrics>& sections ) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision( 3 );
+    out << "{\n  \"sections\": [";
+    for (size_t i=0; i<sections.size(); ++i) {
+        const section_metrics& s = sections[i];
+        out << (i ? "," : "") << "\n    {\n"
+            << "      \"section\": " << json_string( s.section ) << ",\n"
+            << "      \"started\": " << (long long)s.started << ",\n"
+            << "      \"seconds\": " << s.seconds << ",\n"
+            << "      \"success\": " << (s.result || s.cleanup_failed ? "false" : "true") << ",\n"
+            << "      \"phases\": [";
+        for (size_t j=0; j<s.phases.size(); ++j) {
+            const phase_metrics& p = s.phases[j];
+            out << (j ? "," : "") << "\n        { \"phase\": " << json_string( p.name )
+                << ", \"seconds\": " << p.seconds;
+            if (p.bytes)
+                out << ", \"bytes\": " << p.bytes << ", \"bytes_per_second\": " <<
+                    (p.seconds > 0 ? p.bytes / p.seconds : 0.0);
+            out << " }";
+        }
+        out << (s.phases.empty() ? "" : "\n      ") << "]";
+        if (!s.space_holders.empty()) {
+            out << ",\n      \"space_holders\": [";
+            for (size_t j=0; j<s.space_holders.size(); ++j) {
+                const space_holder& h = s.space_holders[j];
+                out << (j ? "," : "") << "\n        { \"snapshot\": " << json_string( h.path ) <<
+                    ", \"exclusive_bytes\": " << h.exclusive << ", \"referenced_bytes\": " << h.referenced << " }";
+            }
+            out << "\n      ]";
+        }
+        out << "\n    }";
+    }
+    out << (sections.empty() ? "" : "\n  ") << "]\n}\n";
+    return out.str();
+}
+
+static string format_textfile( const vector<section_metrics>& sections ) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision( 3 );
+    out << "# HELP btrfs_snap_section_seconds Wall time of the last run of a section.\n"
+        << "# TYPE btrfs_snap_section_seconds gauge\n";
+    for (auto& s: sections)
+        out << "btrfs_snap_section_seconds{section=\"" << label_value( s.section ) << "\"} " << s.seconds << "\n";
+    out << "# HELP btrfs_snap_section_success Whether the last run of a section succeeded.\n"
+        << "# TYPE btrfs_snap_section_success gauge\n";
+    for (auto& s: sections)
+        out << "btrfs_snap_section_success{section=\"" << label_value( s.section ) << "\"} " <<
+            (s.result || s.cleanup_failed ? 0 : 1) << "\n";
+    out << "# HELP btrfs_snap_section_start_timestamp_seconds Start of the last run of a section.\n"
+        << "# TYPE btrfs_snap_section_start_timestamp_seconds gauge\n";
+    for (auto& s: sections)
+        out << "btrfs_snap_section_start_timestamp_seconds{section=\"" << label_value( s.section ) << "\"} " <<
+            (long long)s.started << "\n";
+    out << "# HELP btrfs_snap_phase_seconds Wall time spent in a phase of the last run of a section.\n"
+        << "# TYPE btrfs_snap_phase_seconds gauge\n";
+    for (auto& s: sections)
+        for (auto& p: s.phases)
+            out << "btrfs_snap_phase_seconds{section=\"" << label_value( s.section ) << "\",phase=\"" <<
+                label_value( p.name ) << "\"} " << p.seconds << "\n";
+    out << "# HELP btrfs_snap_phase_bytes Stream bytes moved in a phase of the last run of a section.\n"
+        << "# TYPE btrfs_snap_phase_bytes gauge\n";
+    for (auto& s: sections)
+        for (auto& p: s.phases)
+            if (p.bytes)
+                out << "btrfs_snap_phase_bytes{section=\"" << label_value( s.section ) << "\",phase=\"" <<
+                    label_value( p.name ) << "\"} " << p.bytes << "\n";
+    out << "# HELP btrfs_snap_snapshot_exclusive_bytes Exclusive bytes of the largest snapshots of a section.\n"
+        << "# TYPE btrfs_snap_snapshot_exclusive_bytes gauge\n";
+    for (auto& s: sections)
+        for (auto& h: s.space_holders)
+            out << "btrfs_snap_snapshot_exclusive_bytes{section=\"" << label_value( s.section ) << "\",snapshot=\"" <<
+                label_value( h.path ) << "\"} " << h.exclusive << "\n";
+    return out.str();
+}
+
+// node_exporter may read the file at any time, so it is replaced atomically
+static int write_atomically( string path, const string& data ) {
+    if (replace_file( path, data )) {
+        ERR( "cannot write '" << path << "': " << strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int write_run_report( const vector<section_metrics>& sections, string json_path, string textfile_path ) {
+    int result = EXIT_SUCCESS;
+    if (json_path != "" && write_atomically( json_path, format_json( sections ) ))
+        result = EXIT_FAILURE;
+    if (textfile_path != "" && write_atomically( textfile_path, format_textfile( sections ) ))
+        result = EXIT_FAILURE;
+    return result;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <ctime>
+
+using std::string;
+using std::vector;
+
+// wall time (monotonic clock) and stream bytes of one phase of a section
+// run. phases that run several times (e.g. one transfer per target group)
+// add up.
+struct phase_metrics {
+    string name;
+    double seconds = 0.0;
+    unsigned long long bytes = 0;
+};
+
+// one of the snapshots pinning the most exclusive space in its directory
+struct space_holder {
+    string path;
+    unsigned long long exclusive = 0;
+    unsigned long long referenced = 0;
+};
+
+struct section_metrics {
+    string section;
+    time_t started = 0;
+    double seconds = 0.0;
+    int result = 0;
+    // set by work the section left to the background cleanup
+    bool cleanup_failed = false;
+    vector<phase_metrics> phases;
+    vector<space_holder> space_holders;
+};
+
+// metrics of the section running on this thread, NULL outside of one
+extern thread_local section_metrics* current_metrics;
+
+// times a phase of current_metrics from construction to stop() or
+// destruction. the background cleanup adds its phases to the metrics of
+// the section that queued the work while that section may still run.
+class phase_timer {
+    public:
+        phase_timer( string name );
+        ~phase_timer() { stop(); }
+        void add_bytes( unsigned long long bytes ) { bytes_ += bytes; }
+        void stop();
+    private:
+        string name;
+        bool stopped = false;
+        unsigned long long bytes_ = 0;
+        std::chrono::steady_clock::time_point start;
+};
+
+// marks the section of current_metrics as failed after the fact, for the
+// background cleanup
+void record_cleanup_failure();
+
+// run() with its phases recorded in metrics. a second call for the same
+// section (e.g. its transfer after its snapshot) adds to the first one.
+int measured_run( string section, section_metrics& metrics, std::function<int()> run );
+
+// JSON run report and node_exporter textfile of a run, each skipped when
+// its path is empty. both are replaced atomically.
+int write_run_report( const vector<section_metrics>& sections, string json_path, string textfile_path );
@@ -1,67 +1,123 @@
 #include "nokill.hpp"
+#include "proc.hpp"
 #include <thread>
-#include <mutex>
+#include <atomic>
+#include <string>
 #include <cstdio>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #define KILL_SECONDS_MAX 5
 #define KILL_SECONDS_NUM 5
+#define KILL_GRACE_SECONDS 10
 
-nokill_t nokill_handler = NULL;
-
-static std::mutex kill_mutex;
-static std::thread* kill_thread;
-static bool thread_exit = false;
-
-static double seconds_passed = 0.0;
-static int times_pressed = 0;
-
-static void kill_program( double nsec, int ntim ) {
-    fprintf(stderr, "\nSIGINT %i times in %i seconds. exiting.\n",
-            ntim+1, (int)(nsec+0.5) );
-    thread_exit = true;
-    exit(1);
-}
+static std::thread* kill_thread = NULL;
+static int signal_fd = -1; // SIGINT and SIGTERM
+static int grace_fd = -1; // timer armed by the cancellation
+static int wake_fd = -1; // ends the event loop
+static int cancel_fd = -1; // readable once cancelled
+static std::atomic<bool> cancelled( false );
 
 static void print_kill_info() {
     fprintf(stderr, "\nto kill program, press Ctrl+C %i times in %i seconds\n",
             KILL_SECONDS_NUM+1, KILL_SECONDS_MAX);
 }
 
-static void kill_function( int signum ) {
-    if (signum != SIGINT) return;
-    kill_mutex.lock();
-    if ((int)(seconds_passed+0.5) < KILL_SECONDS_MAX) {
-        if (times_pressed < KILL_SECONDS_NUM) {
-            if (!times_pressed) print_kill_info();
-            times_pressed++;
-        } else {
-            kill_program( seconds_passed, times_pressed );
+static void cancel( const char* reason ) {
+    if (cancelled.exchange( true ))
+        return;
+    fprintf(stderr, "\n%s. stopping, exiting in at most %i seconds.\n", reason, KILL_GRACE_SECONDS);
+    uint64_t one = 1;
+    if (write( cancel_fd, &one, sizeof(one) ) < 0)
+        perror( "eventfd" );
+    kill_children( SIGTERM );
+    struct itimerspec grace = {};
+    grace.it_value.tv_sec = KILL_GRACE_SECONDS;
+    timerfd_settime( grace_fd, 0, &grace, NULL );
+}
+
+static void event_loop() {
+    struct timespec first = {};
+    int times_pressed = 0;
+    for (;;) {
+        struct pollfd fds[3] = { { signal_fd, POLLIN, 0 }, { grace_fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 } };
+        if (poll( fds, 3, -1 ) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror( "poll" );
+            return;
+        }
+        if (fds[2].revents)
+            return;
+        if (fds[1].revents) {
+            fprintf(stderr, "\nnot stopped after %i seconds. exiting.\n", KILL_GRACE_SECONDS);
+            kill_children( SIGKILL );
+            _exit(1);
         }
-    } else {
-        seconds_passed = 0.0;
-        times_pressed++;
+        struct signalfd_siginfo info;
+        if (read( signal_fd, &info, sizeof(info) ) != sizeof(info))
+            continue;
+        if (info.ssi_signo == SIGTERM) {
+            cancel( "SIGTERM" );
+            continue;
+        }
+        struct timespec now;
+        clock_gettime( CLOCK_MONOTONIC, &now );
+        if (!times_pressed || now.tv_sec - first.tv_sec >= KILL_SECONDS_MAX) {
+            first = now;
+            times_pressed = 0;
+            if (!cancelled)
+                print_kill_info();
+        }
+        if (++times_pressed > KILL_SECONDS_NUM)
+            cancel( ("SIGINT " + std::to_string( times_pressed ) + " times").c_str() );
     }
-    kill_mutex.unlock();
 }
 
 void nokill_init() {
-    kill_mutex.unlock();
-    kill_thread = new std::thread( [&](){
-        while (!thread_exit) {
-            usleep(1.e+5);
-            if (times_pressed) {
-                kill_mutex.lock();
-                seconds_passed+=0.1;
-                kill_mutex.unlock();
-            }
-        }
-    } );
-    nokill_handler = kill_function;
-    signal(SIGINT, kill_function);
+    // a receiver that exits early makes writes to its pipe fail with EPIPE
+    // instead of killing us. children get the default back (spawn_process())
+    signal( SIGPIPE, SIG_IGN );
+    sigset_t mask;
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGINT );
+    sigaddset( &mask, SIGTERM );
+    // threads inherit the mask, so the signals only arrive through the fd
+    pthread_sigmask( SIG_BLOCK, &mask, NULL );
+    signal_fd = signalfd( -1, &mask, SFD_CLOEXEC );
+    grace_fd = timerfd_create( CLOCK_MONOTONIC, TFD_CLOEXEC );
+    wake_fd = eventfd( 0, EFD_CLOEXEC );
+    cancel_fd = eventfd( 0, EFD_CLOEXEC );
+    if (signal_fd < 0 || grace_fd < 0 || wake_fd < 0 || cancel_fd < 0) {
+        perror( "nokill" );
+        pthread_sigmask( SIG_UNBLOCK, &mask, NULL );
+        return;
+    }
+    kill_thread = new std::thread( event_loop );
 }
 
 void nokill_clear() {
-    thread_exit = true;
+    if (!kill_thread)
+        return;
+    uint64_t one = 1;
+    if (write( wake_fd, &one, sizeof(one) ) < 0)
+        perror( "eventfd" );
     kill_thread->join();
+    delete kill_thread;
+    kill_thread = NULL;
 }
 
+bool nokill_cancelled() {
+    return cancelled;
+}
+
+int nokill_fd() {
+    return cancel_fd;
+}
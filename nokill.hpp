@@ -3,9 +3,20 @@
 #include <signal.h>
 #include <sys/wait.h>
 
-typedef void (*nokill_t)( int );
-extern nokill_t nokill_handler;
-
+// SIGINT and SIGTERM are blocked in every thread and read from a signalfd by
+// one event loop thread. Ctrl+C is ignored unless pressed KILL_SECONDS_NUM+1
+// times within KILL_SECONDS_MAX seconds; that, or SIGTERM, cancels the run:
+// running children are terminated and jobs stop at their next step, removing
+// what they left half received. a run that has not exited KILL_GRACE_SECONDS
+// later is ended with its children. SIGPIPE is ignored, so writes to a pipe
+// whose reader exited fail with EPIPE. call nokill_init() before any thread
+// is started.
 void nokill_init();
 void nokill_clear();
 
+// whether the run was cancelled
+bool nokill_cancelled();
+
+// readable once the run is cancelled, for poll() loops (-1 without
+// nokill_init())
+int nokill_fd();
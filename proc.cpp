@@ -0,0 +1,291 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "proc.hpp"
+#include "snap.hpp"
+
+#include <mutex>
+#include <set>
+#include <signal.h>
+#include <spawn.h>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+#include <ctime>
+#include <sys/wait.h>
+
+// longer lines are split so a child without newlines cannot grow memory.
+#define OUTPUT_LINE_MAX 4096
+
+// children that have not been reaped yet, for kill_children()
+static std::mutex children_mutex;
+static std::set<pid_t> children;
+
+pid_t spawn_process( const vector<string>& argv, int fd_in, int fd_out, int fd_err,
+        const vector<string>* env ) {
+    vector<char*> args, envp;
+    for (auto& a: argv)
+        args.push_back( const_cast<char*>( a.c_str() ) );
+    args.push_back( NULL );
+    if (env) {
+        for (auto& e: *env)
+            envp.push_back( const_cast<char*>( e.c_str() ) );
+        envp.push_back( NULL );
+    }
+
+    // the child cannot ignore SIGINT without running code of ours between
+    // fork and exec, so it starts with SIGINT blocked instead.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init( &attr );
+    sigset_t mask, defaults;
+    sigemptyset( &mask );
+    sigaddset( &mask, SIGINT );
+    sigemptyset( &defaults );
+    sigaddset( &defaults, SIGPIPE );
+    posix_spawnattr_setsigmask( &attr, &mask );
+    posix_spawnattr_setsigdefault( &attr, &defaults );
+    // its own session and so its own process group, so kill_children()
+    // also reaches what a shell or transport command started in turn. a
+    // background group would be stopped by SIGTTIN as soon as it read the
+    // terminal (e.g. ssh asking for a password); without a controlling
+    // terminal such a prompt fails instead, and stdin reads nothing.
+    posix_spawnattr_setflags( &attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSID );
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init( &actions );
+    if (fd_in >= 0) posix_spawn_file_actions_adddup2( &actions, fd_in, STDIN_FILENO );
+    else posix_spawn_file_actions_addopen( &actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0 );
+    if (fd_out >= 0) posix_spawn_file_actions_adddup2( &actions, fd_out, STDOUT_FILENO );
+    if (fd_err >= 0) posix_spawn_file_actions_adddup2( &actions, fd_err, STDERR_FILENO );
+
+    pid_t pid = -1;
+    int error = posix_spawnp( &pid, args[0], &actions, &attr, args.data(),
+            env ? envp.data() : environ );
+    posix_spawn_file_actions_destroy( &actions );
+    posix_spawnattr_destroy( &attr );
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock( children_mutex );
+    children.insert( pid );
+    return pid;
+}
+
+int spawn_pipeline( const vector<vector<string>>& commands, int fd_in, int fd_out, int fd_err,
+        vector<pid_t>& pids ) {
+    pids.clear();
+    int in = fd_in;
+    for (size_t i=0; i<commands.size(); ++i) {
+        int link[2] = { -1, -1 };
+        if (i+1 < commands.size() && pipe2( link, O_CLOEXEC )) {
+            ERR( "cannot create pipe." );
+            break;
+        }
+        pid_t pid = spawn_process( commands[i], in, i+1 < commands.size() ? link[1] : fd_out, fd_err );
+        if (pid < 0)
+            ERR( "cannot start '" << commands[i][0] << "': " << strerror( errno ) << "." );
+        if (in != fd_in)
+            close( in );
+        if (link[1] >= 0)
+            close( link[1] );
+        in = link[0];
+        if (pid < 0)
+            break;
+        pids.push_back( pid );
+    }
+    if (in != fd_in && in >= 0)
+        close( in );
+    if (pids.size() == commands.size())
+        return EXIT_SUCCESS;
+    // the stages already running see EOF or SIGPIPE and exit on their own
+    wait_pipeline( pids );
+    pids.clear();
+    return EXIT_FAILURE;
+}
+
+int wait_process( pid_t pid ) {
+    // the pid is unregistered before it is reaped, so kill_children() never
+    // hits another process that got the number after it
+    siginfo_t info;
+    while (waitid( P_PID, pid, &info, WEXITED | WNOWAIT ) < 0 && errno == EINTR)
+        ;
+    {
+        std::lock_guard<std::mutex> lock( children_mutex );
+        children.erase( pid );
+    }
+    int status = 0;
+    while (waitpid( pid, &status, 0 ) < 0)
+        if (errno != EINTR)
+            return -1;
+    if (WIFEXITED( status ))
+        return WEXITSTATUS( status );
+    if (WIFSIGNALED( status ))
+        return 128 + WTERMSIG( status );
+    return -1;
+}
+
+void kill_children( int signum ) {
+    std::lock_guard<std::mutex> lock( children_mutex );
+    for (pid_t pid: children)
+        kill( -pid, signum );
+}
+
+int wait_pipeline( const vector<pid_t>& pids ) {
+    int result = 0;
+    for (pid_t pid: pids) {
+        int status = wait_process( pid );
+        if (status && !result)
+            result = status;
+    }
+    return result;
+}
+
+string command_string( const vector<string>& argv ) {
+    string result = "";
+    for (auto& a: argv) {
+        if (result != "")
+            result += " ";
+        bool plain = a != "";
+        for (char c: a)
+            if (!isalnum( (unsigned char)c ) && string("-_./=:,+@%").find( c ) == string::npos)
+                plain = false;
+        if (plain) {
+            result += a;
+        } else {
+            result += "'";
+            for (char c: a)
+                result += c == '\'' ? string("'\\''") : string(1, c);
+            result += "'";
+        }
+    }
+    return result;
+}
+
+string pipeline_string( const vector<vector<string>>& commands ) {
+    string result = "";
+    for (auto& argv: commands)
+        result += (result == "" ? "" : " | ") + command_string( argv );
+    return result;
+}
+
+static string time_stamp() {
+    time_t now = time(NULL);
+    struct tm tstruct;
+    char buf[32];
+    localtime_r( &now, &tstruct );
+    strftime( buf, sizeof(buf), "%H:%M:%S", &tstruct );
+    return buf;
+}
+
+void follow_output( const vector<int>& fds, const vector<string>& names,
+        std::deque<string>* tail, size_t tail_lines ) {
+    vector<struct pollfd> polls;
+    for (int fd: fds)
+        polls.push_back( { fd, POLLIN, 0 } );
+    vector<string> partial( fds.size() );
+    size_t open_fds = fds.size();
+
+    auto emit = [&]( size_t i ) {
+        SHELL( time_stamp() << " " << names[i] << ": " << partial[i] );
+        if (tail) {
+            tail->push_back( names[i] + ": " + partial[i] );
+            while (tail->size() > tail_lines)
+                tail->pop_front();
+        }
+        partial[i].clear();
+    };
+
+    char buf[1 << 16];
+    while (open_fds) {
+        if (poll( polls.data(), polls.size(), -1 ) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (size_t i=0; i<polls.size(); ++i) {
+            if (polls[i].fd < 0 || !polls[i].revents)
+                continue;
+            ssize_t n = read( polls[i].fd, buf, sizeof(buf) );
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                if (!partial[i].empty())
+                    emit( i );
+                close( polls[i].fd );
+                polls[i].fd = -1;
+                open_fds--;
+                continue;
+            }
+            for (ssize_t j=0; j<n; ++j) {
+                if (buf[j] == '\n')
+                    emit( i );
+                else if (partial[i].size() < OUTPUT_LINE_MAX)
+                    partial[i] += buf[j];
+                else {
+                    emit( i );
+                    partial[i] += buf[j];
+                }
+            }
+        }
+    }
+    for (auto& p: polls)
+        if (p.fd >= 0)
+            close( p.fd );
+}
+
+int run_process( const vector<string>& argv, const vector<string>* env ) {
+    int out[2], err[2];
+    if (pipe2( out, O_CLOEXEC ))
+        return -1;
+    if (pipe2( err, O_CLOEXEC )) {
+        close( out[0] );
+        close( out[1] );
+        return -1;
+    }
+    pid_t pid = spawn_process( argv, -1, out[1], err[1], env );
+    close( out[1] );
+    close( err[1] );
+    if (pid < 0) {
+        ERR( "cannot start '" << argv[0] << "': " << strerror( errno ) << "." );
+        close( out[0] );
+        close( err[0] );
+        return -1;
+    }
+
+    string name = argv[0].substr( argv[0].rfind( '/' ) + 1 );
+    std::deque<string> tail;
+    follow_output( { out[0], err[0] }, { name, name + "/err" }, &tail );
+    int status = wait_process( pid );
+    if (status) {
+        ERR( "'" << command_string( argv ) << "' failed with status " << status <<
+                (tail.empty() ? "." : ". last output:") );
+        for (auto& line: tail)
+            ERR( "  " << line );
+    }
+    return status;
+}
+
+int capture_process( const vector<string>& argv, string& output ) {
+    int out[2];
+    if (pipe2( out, O_CLOEXEC ))
+        return -1;
+    pid_t pid = spawn_process( argv, -1, out[1], out[1] );
+    close( out[1] );
+    output.clear();
+    char buf[4096];
+    ssize_t n;
+    while ((n = read( out[0], buf, sizeof(buf) )) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        output.append( buf, n );
+    }
+    close( out[0] );
+    return pid < 0 ? -1 : wait_process( pid );
+}
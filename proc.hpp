@@ -0,0 +1,62 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <sys/types.h>
+
+using std::string;
+using std::vector;
+
+// lines of child output kept for error reports.
+#define OUTPUT_TAIL_LINES 20
+
+// starts argv[0] (looked up in PATH) with posix_spawn, without a shell and
+// without copying our address space, with fd_in, fd_out and fd_err as its
+// standard descriptors (-1: inherit, /dev/null for stdin) and env as its
+// environment (NULL: ours). the child starts with SIGINT blocked in a
+// session of its own without a controlling terminal, so Ctrl+C at the
+// terminal does not reach it (kill_children() does) and it cannot prompt
+// there. returns the pid, or -1 with errno set.
+pid_t spawn_process( const vector<string>& argv, int fd_in, int fd_out, int fd_err,
+        const vector<string>* env = NULL );
+
+// starts the commands like a shell pipeline: each one reads the output of
+// the previous one through a pipe, the first one reads fd_in and the last
+// one writes fd_out. all of them write errors to fd_err. pids receives one
+// pid per command. if one cannot be started, the started ones are waited
+// for and EXIT_FAILURE is returned.
+int spawn_pipeline( const vector<vector<string>>& commands, int fd_in, int fd_out, int fd_err,
+        vector<pid_t>& pids );
+
+// waits for pid. returns its exit status, 128+signal if it was killed or -1.
+int wait_process( pid_t pid );
+
+// sends signum to the process group of every child started by
+// spawn_process() that has not been waited for yet.
+void kill_children( int signum );
+
+// waits for all pids and returns the first non-zero status, like a shell
+// with pipefail.
+int wait_pipeline( const vector<pid_t>& pids );
+
+// shell-quoted representation of argv for logging and dry runs.
+string command_string( const vector<string>& argv );
+
+// the commands joined by " | ".
+string pipeline_string( const vector<vector<string>>& commands );
+
+// reads the given descriptors with poll() until all of them reach EOF and
+// logs every line as it arrives, prefixed by the matching name and a time
+// stamp. the last tail_lines lines are kept in tail. closes the descriptors.
+void follow_output( const vector<int>& fds, const vector<string>& names,
+        std::deque<string>* tail = NULL, size_t tail_lines = OUTPUT_TAIL_LINES );
+
+// runs argv with stdout and stderr connected to follow_output(). returns
+// the exit status like wait_process(); on failure the tail of the output is
+// logged again.
+int run_process( const vector<string>& argv, const vector<string>* env = NULL );
+
+// runs argv and stores its stdout and stderr in output instead of logging
+// them. for short queries like "btrfs --version".
+int capture_process( const vector<string>& argv, string& output );
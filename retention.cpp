@@ -0,0 +1,56 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "retention.hpp"
+#include "snap.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+vector<string> plan_retention( const vector<string>& paths, const retention_policy& policy,
+        const std::set<string>& protect ) {
+    struct snapshot {
+        string path;
+        time_t time;
+        bool keep;
+    };
+    vector<snapshot> snapshots;
+    for (auto& path: paths) {
+        time_t time;
+        if (snapshot_time( path, time ))
+            snapshots.push_back( { path, time, protect.count( base_name( path ) ) > 0 } );
+    }
+    std::sort( snapshots.begin(), snapshots.end(),
+            []( const snapshot& a, const snapshot& b ){ return a.time > b.time; } );
+
+    for (size_t i=0; i<snapshots.size() && i<policy.keep_last; ++i)
+        snapshots[i].keep = true;
+
+    // newest snapshot of each period, newest periods first
+    const std::pair<unsigned, const char*> buckets[] = {
+        { policy.hourly, "%Y-%m-%d %H" }, { policy.daily, "%Y-%m-%d" },
+        { policy.weekly, "%G-%V" }, { policy.monthly, "%Y-%m" } };
+    for (auto& bucket: buckets) {
+        unsigned kept = 0;
+        string last_period = "";
+        for (size_t i=0; i<snapshots.size() && kept < bucket.first; ++i) {
+            struct tm local;
+            localtime_r( &snapshots[i].time, &local );
+            char period[32];
+            strftime( period, sizeof(period), bucket.second, &local );
+            if (last_period == period)
+                continue;
+            last_period = period;
+            snapshots[i].keep = true;
+            kept++;
+        }
+    }
+
+    vector<string> expired;
+    for (auto s = snapshots.rbegin(); s != snapshots.rend(); ++s)
+        if (!s->keep)
+            expired.push_back( s->path );
+    return expired;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "scan.hpp"
+
+#include <string>
+#include <vector>
+#include <set>
+#include <ctime>
+
+using std::string;
+using std::vector;
+
+// how many snapshots to keep: the keep_last newest ones, and the newest one
+// of each of the last hourly hours, daily days, weekly (iso) weeks and
+// monthly months that have a snapshot. a bucket count of 0 disables it.
+struct retention_policy {
+    unsigned keep_last = 0;
+    unsigned hourly = 0;
+    unsigned daily = 0;
+    unsigned weekly = 0;
+    unsigned monthly = 0;
+};
+
+// the paths (in any order) that policy does not keep, oldest first. paths
+// whose base name is in protect and snapshots without a date in their name
+// are always kept. O(n log n) in the number of paths.
+vector<string> plan_retention( const vector<string>& paths, const retention_policy& policy,
+        const std::set<string>& protect );
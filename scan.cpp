@@ -0,0 +1,198 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "scan.hpp"
+#include "snap.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DATE_LEN 19 // YYYY-MM-DD_HH-MM-SS
+// a few thousand entries per getdents64 call, which matters on slow disks
+#define DENTS_BUFFER (256 << 10)
+
+// days since 1970-01-01 of a gregorian date
+static long days_from_civil( long y, unsigned m, unsigned d ) {
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long)doe - 719468;
+}
+
+// seconds since 1970-01-01 00:00 wall clock time of the date in p[0..len)
+static bool parse_date( const char* p, size_t len, long long& wall ) {
+    static const char layout[] = "0000-00-00_00-00-00";
+    if (len != DATE_LEN)
+        return false;
+    for (size_t i=0; i<len; ++i)
+        if (layout[i] == '0' ? p[i] < '0' || p[i] > '9' : p[i] != layout[i])
+            return false;
+    auto number = [&]( size_t pos, size_t digits ){
+        int value = 0;
+        for (size_t i=pos; i<pos+digits; ++i)
+            value = value * 10 + (p[i] - '0');
+        return value;
+    };
+    int year = number( 0, 4 ), month = number( 5, 2 ), day = number( 8, 2 );
+    int hour = number( 11, 2 ), min = number( 14, 2 ), sec = number( 17, 2 );
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60)
+        return false;
+    wall = days_from_civil( year, month, day ) * 86400LL + hour * 3600 + min * 60 + sec;
+    return true;
+}
+
+// utc offset of local time at 00:00 of day. mktime() costs a microsecond
+// or two, too much for every snapshot of a long series, so the offsets
+// are remembered per thread.
+static long midnight_offset( long day ) {
+    static thread_local std::unordered_map<long, long> offsets;
+    auto known = offsets.find( day );
+    if (known != offsets.end())
+        return known->second;
+    struct tm local = {};
+    local.tm_year = 70;
+    local.tm_mday = 1 + day; // normalized by mktime()
+    local.tm_isdst = -1;
+    long offset = day * 86400L - (long)mktime( &local );
+    offsets[day] = offset;
+    return offset;
+}
+
+// epoch of a wall clock time. only on the days the clocks change are both
+// offsets tried; ambiguous is set if both fit, and hint (if any) decides.
+static time_t local_epoch( long long wall, time_t hint, bool* ambiguous = NULL ) {
+    long day = wall / 86400 - (wall % 86400 < 0);
+    long before = midnight_offset( day ), after = midnight_offset( day + 1 );
+    if (before == after)
+        return wall - before;
+    time_t a = wall - before, b = wall - after;
+    auto fits = []( time_t t, long offset ){
+        struct tm local;
+        return localtime_r( &t, &local ) && local.tm_gmtoff == offset;
+    };
+    bool fits_a = fits( a, before ), fits_b = fits( b, after );
+    if (!fits_a || !fits_b)
+        return fits_b ? b : a;
+    if (ambiguous)
+        *ambiguous = true;
+    if (hint)
+        return std::llabs( (long long)(hint - a) ) <= std::llabs( (long long)(hint - b) ) ? a : b;
+    return std::min( a, b );
+}
+
+bool snapshot_time( string name, time_t& time, time_t hint ) {
+    name = base_name( name );
+    long long wall;
+    if (name.size() < DATE_LEN || !parse_date( name.c_str() + name.size() - DATE_LEN, DATE_LEN, wall ))
+        return false;
+    time = local_epoch( wall, hint );
+    return true;
+}
+
+// listings of unchanged directories are reused, which spares the daemon
+// from rereading every directory on each run. a directory that changed
+// within the last two seconds is not cached: its timestamp may not move
+// again for a change in the same clock tick.
+struct cached_listing {
+    struct timespec mtime;
+    off_t size;
+    vector<snapshot_entry> entries;
+    vector<string> paths;
+};
+static std::mutex listing_mutex;
+static std::map<string, std::shared_ptr<const cached_listing>> listings;
+
+// dir has to end with a slash
+static std::shared_ptr<const cached_listing> scan( string dir, string prefix ) {
+    std::shared_ptr<cached_listing> listing( new cached_listing() );
+    int fd = open( dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if (fd < 0)
+        return listing;
+    string key = dir + '\0' + prefix;
+    struct stat st;
+    bool cacheable = fstat( fd, &st ) == 0 && st.st_mtim.tv_sec < time( NULL ) - 1;
+    if (cacheable) {
+        std::lock_guard<std::mutex> lock( listing_mutex );
+        auto cached = listings.find( key );
+        if (cached != listings.end() && cached->second->mtime.tv_sec == st.st_mtim.tv_sec &&
+                cached->second->mtime.tv_nsec == st.st_mtim.tv_nsec && cached->second->size == st.st_size) {
+            close( fd );
+            return cached->second;
+        }
+    }
+
+    vector<snapshot_entry>& entries = listing->entries;
+    std::unique_ptr<char[]> buf( new char[DENTS_BUFFER] );
+    ssize_t n;
+    while ((n = getdents64( fd, buf.get(), DENTS_BUFFER )) > 0) {
+        for (ssize_t pos = 0; pos < n; ) {
+            const struct dirent64* entry = reinterpret_cast<const struct dirent64*>( buf.get() + pos );
+            pos += entry->d_reclen;
+            const char* name = entry->d_name;
+            size_t len = strlen( name );
+            long long wall;
+            if (len != prefix.size() + DATE_LEN || memcmp( name, prefix.data(), prefix.size() ) != 0 ||
+                    !parse_date( name + prefix.size(), DATE_LEN, wall ))
+                continue;
+            if (entry->d_type != DT_DIR) {
+                struct stat target;
+                if ((entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) ||
+                        fstatat( fd, name, &target, 0 ) || !S_ISDIR( target.st_mode ))
+                    continue;
+            }
+            bool ambiguous = false;
+            time_t time = local_epoch( wall, 0, &ambiguous );
+            if (ambiguous) {
+                // taken in the hour the clocks were turned back: the
+                // subvolume's birth time tells which of the two it was
+                struct statx sx;
+                if (statx( fd, name, 0, STATX_BTIME, &sx ) == 0 && (sx.stx_mask & STATX_BTIME))
+                    time = local_epoch( wall, sx.stx_btime.tv_sec );
+            }
+            entries.push_back( { string( name, len ), time } );
+        }
+    }
+    if (n < 0) {
+        WARN( "cannot read directory '" << dir << "'." );
+        cacheable = false;
+    }
+    close( fd );
+    std::sort( entries.begin(), entries.end(), []( const snapshot_entry& a, const snapshot_entry& b ){
+            return a.time != b.time ? a.time < b.time : a.name < b.name; } );
+    listing->paths.reserve( entries.size() );
+    for (auto& entry: entries)
+        listing->paths.push_back( dir + entry.name + "/" );
+
+    if (cacheable) {
+        listing->mtime = st.st_mtim;
+        listing->size = st.st_size;
+        std::lock_guard<std::mutex> lock( listing_mutex );
+        listings[key] = listing;
+    }
+    return listing;
+}
+
+vector<snapshot_entry> scan_snapshots( string dir, string prefix ) {
+    if (dir.size() && dir.back() != '/')
+        dir += "/";
+    return scan( dir, prefix )->entries;
+}
+
+vector<string> snapshot_paths( string dir, string prefix ) {
+    if (dir.size() && dir.back() != '/')
+        dir += "/";
+    return scan( dir, prefix )->paths;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ctime>
+
+using std::string;
+using std::vector;
+
+// a snapshot of a series, named prefix + YYYY-MM-DD_HH-MM-SS in local time.
+// time is the epoch of that date, so ordering by it stays right when the
+// clocks are turned back.
+struct snapshot_entry {
+    string name;
+    time_t time;
+};
+
+// local time a snapshot was taken, parsed from the YYYY-MM-DD_HH-MM-SS at
+// the end of its name. false if there is none. a date from the hour that
+// repeats when the clocks are turned back is read as the earlier one, or
+// as the one closer to hint if given (e.g. the subvolume's birth time).
+bool snapshot_time( string name, time_t& time, time_t hint = 0 );
+
+// the snapshots of series prefix in dir, oldest first: subdirectories named
+// prefix followed by a date, nothing else. reads the directory with
+// getdents64 in large batches and stats no entry unless the file system
+// does not report its type. listings of unchanged directories are reused.
+vector<snapshot_entry> scan_snapshots( string dir, string prefix );
+
+// scan_snapshots() as "dir/name/" paths
+vector<string> snapshot_paths( string dir, string prefix );
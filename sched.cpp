@@ -0,0 +1,114 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "sched.hpp"
+#include "backend.hpp"
+#include "nokill.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+snap_job::snap_job( string name_, const snapshot_setup& setup_ ):
+    name( name_ ), setup( setup_ ) {
+    string local_fs = fs_identity( setup.snapshot_dir );
+    resources.insert( "series:" + local_fs + ":" + setup.snapshot_dir + ":" +
+            setup.host_name + "_" + setup.backup_name );
+    // sections sending over the same transport share the link
+    if (setup.transfer && setup.transport != "") {
+        resources.insert( "transport:" + setup.transport );
+    } else if (setup.transfer) {
+        for (auto& dir: setup.remote_snapshot_dirs()) {
+            string remote_fs = fs_identity( dir );
+            if (remote_fs != "")
+                resources.insert( "remote:" + remote_fs );
+        }
+    }
+}
+
+bool snap_job::conflicts( const snap_job& other, job_phase phase ) const {
+    for (auto& r: resources)
+        if (other.resources.count( r ) && (phase != job_create || r.compare( 0, 7, "series:" ) == 0))
+            return true;
+    return false;
+}
+
+int snap_job::run( job_phase phase ) {
+    log_tag = name;
+    CFG( (phase == job_create ? "snapshot" : phase == job_transfer ? "transfer" : "job") << " started" );
+    result = measured_run( name, metrics, [&](){
+        if (phase == job_create)
+            return snap_create( setup, snapshot_name );
+        if (phase == job_transfer)
+            return snap_transfer( setup, snapshot_name );
+        return snap_and_transfer( setup );
+    } );
+    CFG( (phase == job_create ? "snapshot" : phase == job_transfer ? "transfer" : "job") <<
+            " finished " << (result ? "with errors" : "successfully") );
+    return result;
+}
+
+int run_jobs( vector<snap_job>& jobs, unsigned max_parallel, job_phase phase ) {
+    enum { pending, running, finished };
+    vector<int> state( jobs.size(), pending );
+    vector<std::thread> threads( jobs.size() );
+    std::mutex mutex;
+    std::condition_variable changed;
+    unsigned num_running = 0, num_finished = 0;
+    bool failed = false;
+
+    std::unique_lock<std::mutex> lock( mutex );
+    while (num_finished < jobs.size()) {
+        // a cancelled run starts no more jobs
+        if (nokill_cancelled())
+            failed = true;
+        for (unsigned i=0; i<jobs.size() && !failed; ++i) {
+            if (state[i] != pending)
+                continue;
+            if (max_parallel && num_running >= max_parallel)
+                break;
+            // a job waits for running jobs and for earlier pending jobs it
+            // shares a resource with, so same-disk jobs keep config order.
+            bool blocked = false;
+            for (unsigned j=0; j<jobs.size() && !blocked; ++j)
+                if (j != i && (state[j] == running || (state[j] == pending && j < i)))
+                    blocked = jobs[i].conflicts( jobs[j], phase );
+            if (blocked)
+                continue;
+            state[i] = running;
+            num_running++;
+            threads[i] = std::thread( [&, i](){
+                int result = jobs[i].run( phase );
+                std::lock_guard<std::mutex> guard( mutex );
+                state[i] = finished;
+                num_running--;
+                num_finished++;
+                if (result)
+                    failed = true;
+                changed.notify_all();
+            } );
+        }
+        if (failed && num_running == 0)
+            break;
+        changed.wait( lock );
+    }
+    lock.unlock();
+
+    for (auto& t: threads)
+        if (t.joinable())
+            t.join();
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int run_jobs_two_phase( vector<snap_job>& jobs, unsigned max_parallel ) {
+    CFG( "creating the snapshots of " << jobs.size() << " section(s)." );
+    if (run_jobs( jobs, max_parallel, job_create ))
+        return EXIT_FAILURE;
+    CFG( "transferring." );
+    for (auto& job: jobs)
+        job.setup.async_cleanup = true;
+    return run_jobs( jobs, max_parallel, job_transfer );
+}
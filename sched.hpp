@@ -0,0 +1,43 @@
+#pragma once
+
+#include "snap.hpp"
+#include "metrics.hpp"
+
+#include <string>
+#include <vector>
+#include <set>
+
+using std::string;
+using std::vector;
+
+// what run_jobs() runs of each job: all of snap_and_transfer(), or only
+// its snapshot or its transfer half (see snap_create()/snap_transfer()).
+enum job_phase { job_all, job_create, job_transfer };
+
+// one config section. jobs that share a resource (the snapshot series they
+// create/delete in or the file system they send to) run one after another
+// in config order, all others run concurrently.
+class snap_job {
+    public:
+        snap_job( string name, const snapshot_setup& setup );
+        string name;
+        snapshot_setup setup;
+        std::set<string> resources;
+        int result = EXIT_SUCCESS;
+        section_metrics metrics;
+        // set by the create phase for the transfer phase
+        string snapshot_name;
+
+        // creating snapshots only touches the snapshot series
+        bool conflicts( const snap_job& other, job_phase phase = job_all ) const;
+        int run( job_phase phase = job_all );
+};
+
+// runs phase of all jobs, at most max_parallel at a time (0: no limit). no
+// new jobs are started once one has failed.
+int run_jobs( vector<snap_job>& jobs, unsigned max_parallel, job_phase phase = job_all );
+
+// creates the snapshots of all jobs first, so they are taken at nearly the
+// same time, then transfers and cleans up. deletions are queued in the
+// background meanwhile, so one job's cleanup overlaps the next one's send.
+int run_jobs_two_phase( vector<snap_job>& jobs, unsigned max_parallel );
@@ -5,30 +5,35 @@
 
 #include "nokill.hpp"
 #include "snap.hpp"
+#include "proc.hpp"
+#include "transfer.hpp"
+#include "backend.hpp"
+#include "cleanup.hpp"
+#include "archive.hpp"
+#include "journal.hpp"
+#include "metrics.hpp"
+#include "retention.hpp"
+#include "match.hpp"
+#include "transport.hpp"
+#include "verify.hpp"
+#include "scan.hpp"
 
 #include <vector>
-#include <glob.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <ctime>
-#include <linux/limits.h>
 #include <unistd.h>
 #include <algorithm>
-#include <fstream>
-
-string snapshot_setup::host_name = "cygnus";
-string snapshot_setup::backup_name = "home";
-string snapshot_setup::backup_dir = "/home/";
-string snapshot_setup::snapshot_dir = "/.snapshots/";
-string snapshot_setup::remote_snapshot_dir = "/mnt/backup-mypass/snapshots/";
-unsigned snapshot_setup::keep_remote_snapshots_num = 10;
-unsigned snapshot_setup::keep_snapshots_num = 10;
-bool snapshot_setup::dry_run = false;
-string snapshot_setup::pre_command = "";
-string snapshot_setup::post_command = "";
-bool snapshot_setup::transfer = true;
-bool snapshot_setup::create = true;
-bool snapshot_setup::do_sync = true;
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <climits>
+#include <iomanip>
+
+thread_local string log_tag = "";
 
 using std::vector;
 using std::string;
@@ -36,156 +41,738 @@ using std::cerr;
 using std::endl;
 using std::sort;
 using std::cout;
+using std::pair;
+
+// paths written to by sections that left syncing to snap_finalize_sync()
+static vector<string> unsynced;
+static std::mutex unsynced_mutex;
 
 static int has_dir( string dir ); // 0: exists, 1: is file, -1: cannot access
-static vector<string> glob_list( string expr );
-static int execute( string command );
+static int execute( string command, const vector<string>& variables = {} );
 static string date_now();
-static bool has_root_priv();
-
-static int execute_pre_command( string command );
-static int execute_post_command( string command, string snapshot_name );
-static int btrfs_sync();
-static int btrfs_create_snapshot( string backup_dir, string name );
-static int btrfs_transfer_snapshot_difference( string prev_name, string name, string out_dir );
-static int btrfs_transfer_full_snapshot( string name, string out_dir );
-static int btrfs_delete_snapshot( string name );
+static bool has_root_priv( const snapshot_setup& setup );
+
+static int execute_pre_command( const snapshot_setup& setup, string command );
+static int execute_post_command( const snapshot_setup& setup, string command, string snapshot_name );
+static int transfer_to_remotes( const snapshot_setup& setup, const vector<string>& local_snapshots,
+        string current_snap_name, const vector<string>& remote_dirs );
+static vector<string> send_command( const snapshot_setup& setup, const vector<string>& args );
+static transfer_options make_transfer_options( const snapshot_setup& setup );
+static vector<string> expired_local( const snapshot_setup& setup, const vector<string>& local_snapshots,
+        string current_snap_name );
+static vector<string> expired_remote( const snapshot_setup& setup, string dir,
+        const vector<string>& remote_snapshots, btrfs_backend* backend );
+static vector<string> apply_deletion_budget( const snapshot_setup& setup, const vector<string>& expired,
+        btrfs_backend* remote = NULL, size_t num_remote = 0 );
+static int btrfs_sync( const snapshot_setup& setup, const vector<string>& paths,
+        btrfs_backend* backend = NULL );
+static int btrfs_create_snapshot( const snapshot_setup& setup, string backup_dir, string name );
+static bool source_unchanged( const snapshot_setup& setup, string& newest );
+static int btrfs_delete_snapshots( const snapshot_setup& setup, const vector<string>& names,
+        btrfs_backend* backend = NULL );
+static btrfs_backend* remote_backend( const snapshot_setup& setup );
+
+int snap_and_transfer( const snapshot_setup& setup ) {
+    string current_snap_name;
+    if (snap_create( setup, current_snap_name ) || nokill_cancelled())
+        return EXIT_FAILURE;
+    return snap_transfer( setup, current_snap_name );
+}
 
-int snap_and_transfer() {
+int snap_create( const snapshot_setup& setup, string& current_snap_name ) {
 
     string run_date = date_now();
 
-    if (!has_root_priv()) {
+    if (!has_root_priv( setup )) {
         ERR( "cannot get root privileges." );
         return EXIT_FAILURE;
     }
 
-    if (has_dir( snapshot_setup::snapshot_dir )) {
-        ERR( "snapshot directory '" << snapshot_setup::snapshot_dir << "' does not exist." );
+    if (has_dir( setup.snapshot_dir )) {
+        ERR( "snapshot directory '" << setup.snapshot_dir << "' does not exist." );
+        return EXIT_FAILURE;
+    }
+
+    if (has_dir( setup.backup_dir )) {
+        ERR( "backup directory '" << setup.backup_dir << "' does not exist." );
+        return EXIT_FAILURE;
+    }
+
+    if (setup.compressed_data != "auto" && setup.compressed_data != "true" &&
+            setup.compressed_data != "false") {
+        ERR( "compressed_data must be 'auto', 'true' or 'false'." );
+        return EXIT_FAILURE;
+    }
+
+    if (setup.target != "btrfs" && setup.target != "archive") {
+        ERR( "target must be 'btrfs' or 'archive'." );
+        return EXIT_FAILURE;
+    }
+
+    if (!get_backend( setup.backend )) {
+        ERR( "backend must be 'auto', 'ioctl', 'cli' or 'mock'." );
+        return EXIT_FAILURE;
+    }
+
+    if (setup.transport != "" && !remote_backend( setup )) {
+        ERR( "transport_compression must be 'none', 'zstd' (level 1-19) or 'lz4' (level 1-12)." );
+        return EXIT_FAILURE;
+    }
+
+    if (setup.transport != "" && setup.target == "archive") {
+        ERR( "archives are written to local directories, target = archive cannot use a transport." );
+        return EXIT_FAILURE;
+    }
+
+    if (setup.backend == "mock") {
+        btrfs_mock_backend* mock = static_cast<btrfs_mock_backend*>( get_backend( "mock" ) );
+        mock->latency_ms = setup.mock_latency;
+        mock->stream_size = setup.mock_stream_size;
+    }
+
+    if (setup.io_class != "none" && setup.io_class != "realtime" && setup.io_class != "best-effort" &&
+            setup.io_class != "idle") {
+        ERR( "io_class must be 'none', 'realtime', 'best-effort' or 'idle'." );
         return EXIT_FAILURE;
     }
 
-    if (has_dir( snapshot_setup::backup_dir )) {
-        ERR( "backup directory '" << snapshot_setup::backup_dir << "' does not exist." );
+    if (setup.io_level < 0 || setup.io_level > 7) {
+        ERR( "io_level must be between 0 and 7." );
         return EXIT_FAILURE;
     }
 
-    if (snapshot_setup::keep_snapshots_num < 1) {
+    if (bandwidth_schedule().parse( setup.bandwidth_schedule ))
+        return EXIT_FAILURE;
+
+    if (setup.keep_snapshots_num < 1) {
         ERR( "snapshot num kept must be larger than one." );
         return EXIT_FAILURE;
     }
 
-    if (snapshot_setup::keep_remote_snapshots_num < 1) {
+    if (setup.keep_remote_snapshots_num < 1) {
         ERR( "remote snapshot num kept must be larger than one." );
         return EXIT_FAILURE;
     }
 
-    if (snapshot_setup::pre_command != "")
-        if (execute_pre_command( snapshot_setup::pre_command ))
+    if (apply_priorities( setup ))
+        return EXIT_FAILURE;
+
+    if (setup.pre_command != "")
+        if (execute_pre_command( setup, setup.pre_command ))
             return EXIT_FAILURE;
 
-    string current_snap_name = snapshot_setup::host_name + "_" + snapshot_setup::backup_name + "_" + run_date;
-    string current_snap_glob = snapshot_setup::host_name + "_" + snapshot_setup::backup_name + "_*/";
+    current_snap_name = setup.host_name + "_" + setup.backup_name + "_" + run_date;
 
-    if (snapshot_setup::create)
-        if (btrfs_create_snapshot( snapshot_setup::backup_dir, snapshot_setup::snapshot_dir + current_snap_name ))
+    if (setup.create) {
+        string newest;
+        if (setup.skip_unchanged && source_unchanged( setup, newest )) {
+            INFO( "'" << setup.backup_dir << "' unchanged since '" << newest << "', skipping snapshot." );
+            current_snap_name = newest;
+            return EXIT_SUCCESS;
+        }
+        if (btrfs_create_snapshot( setup, setup.backup_dir, setup.snapshot_dir + current_snap_name ))
             return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
-    vector<string> local_snapshots = glob_list( snapshot_setup::snapshot_dir + current_snap_glob );
-    sort( local_snapshots.begin(), local_snapshots.end() );
+int snap_transfer( const snapshot_setup& setup, string current_snap_name ) {
+    // priorities belong to the thread, which need not be the one that ran
+    // snap_create()
+    if (apply_priorities( setup ))
+        return EXIT_FAILURE;
+
+    // an earlier section of the series may still have deletions queued
+    // here; they would be planned (and picked as parents) again
+    vector<string> dirs = { setup.snapshot_dir };
+    if (setup.transfer)
+        for (auto& dir: setup.remote_snapshot_dirs())
+            dirs.push_back( dir );
+    cleanup_wait_for( dirs );
+
+    string prefix = setup.host_name + "_" + setup.backup_name + "_";
+    vector<string> local_snapshots = snapshot_paths( setup.snapshot_dir, prefix );
+    if (local_snapshots.empty()) {
+        ERR( "no snapshot of '" << prefix << "' in '" << setup.snapshot_dir << "'." );
+        return EXIT_FAILURE;
+    }
+
+    if (!setup.create)
+        current_snap_name = base_name( local_snapshots.back() );
 
-    if (!snapshot_setup::create)
-        current_snap_name = local_snapshots[local_snapshots.size()-1].substr(snapshot_setup::snapshot_dir.length(),
-                string::npos);
+    reverse( local_snapshots.begin(), local_snapshots.end() );
 
-    if (has_dir( snapshot_setup::remote_snapshot_dir ) || !snapshot_setup::transfer ) {
-        if (!snapshot_setup::transfer)
+    btrfs_backend* remote = remote_backend( setup );
+    vector<string> remote_dirs;
+    if (setup.transfer) {
+        for (auto& dir: setup.remote_snapshot_dirs()) {
+            if (!remote->directory_exists( dir ))
+                WARN( "remote snapshot directory '" << dir << "' not present." );
+            else
+                remote_dirs.push_back( dir );
+        }
+    }
+
+    // a failed deletion or verification does not stop the run, it is
+    // reported at the end
+    bool cleanup_failed = false, verify_failed = false;
+    if (remote_dirs.empty()) {
+        if (!setup.transfer)
             INFO( "transfer disabled. local operation." );
-        else if (has_dir( snapshot_setup::remote_snapshot_dir ))
-            WARN( "remote snapshot directory '" << snapshot_setup::remote_snapshot_dir <<
-                    "' not present. local operation." );
-        if (local_snapshots.size() > snapshot_setup::keep_snapshots_num) {
-            unsigned del_num = 0;
-            for (unsigned i=snapshot_setup::keep_snapshots_num; i<local_snapshots.size(); ++i) {
-                if (btrfs_delete_snapshot( local_snapshots[del_num] ))
-                    return EXIT_FAILURE;
-                del_num++;
+        else
+            WARN( "no remote snapshot directory present. local operation." );
+        if (btrfs_delete_snapshots( setup, apply_deletion_budget( setup,
+                        expired_local( setup, local_snapshots, current_snap_name ) ) ))
+            cleanup_failed = true;
+    } else {
+        if (transfer_to_remotes( setup, local_snapshots, current_snap_name, remote_dirs ) ||
+                nokill_cancelled())
+            return EXIT_FAILURE;
+
+        INFO( "cleaning up..." );
+        vector<string> expired;
+        std::map<string, vector<string>> listed;
+        for (auto& dir: remote_dirs) {
+            if (setup.target == "archive") {
+                phase_timer timer( "delete" );
+                if (archive_retention( dir, prefix, setup.keep_remote_snapshots_num, setup.dry_run ))
+                    cleanup_failed = true;
+                continue;
             }
+            listed[dir] = remote->list_snapshots( dir, prefix );
+            for (auto& path: expired_remote( setup, dir, listed[dir], remote ))
+                expired.push_back( path );
         }
-    } else {
-        vector<string> remote_snapshots = glob_list( snapshot_setup::remote_snapshot_dir + current_snap_glob );
-        sort( remote_snapshots.begin(), remote_snapshots.end() );
-        reverse( remote_snapshots.begin(), remote_snapshots.end() );
-        reverse( local_snapshots.begin(), local_snapshots.end() );
-        if (remote_snapshots.size() == 0) {
-            INFO( "no remote snapshots available, sending full snapshot to remote..." );
-            if (btrfs_transfer_full_snapshot( snapshot_setup::snapshot_dir + current_snap_name,
-                        snapshot_setup::remote_snapshot_dir ))
-                return EXIT_FAILURE;
+        size_t num_remote = expired.size();
+        for (auto& path: expired_local( setup, local_snapshots, current_snap_name ))
+            expired.push_back( path );
+        vector<string> planned = apply_deletion_budget( setup, expired, remote, num_remote );
+        if (setup.transport == "") {
+            if (btrfs_delete_snapshots( setup, planned ))
+                cleanup_failed = true;
         } else {
-            string match_base_name = "";
-            for (string local: local_snapshots) {
-                for (string remote: remote_snapshots) {
-                    string local_base = local.substr( snapshot_setup::snapshot_dir.length(),
-                            string::npos );
-                    string remote_base = remote.substr( snapshot_setup::remote_snapshot_dir.length(),
-                            string::npos );
-                    if (local_base == remote_base) {
-                        match_base_name = local_base;
-                        goto breakloops;
-                    }
-                }
-            }
-breakloops:
-            if (match_base_name == "") {
-                INFO( "could not find matching snapshots, sending full snapshot to remote..." );
-                if (btrfs_transfer_full_snapshot( snapshot_setup::snapshot_dir + current_snap_name,
-                            snapshot_setup::remote_snapshot_dir ))
-                    return EXIT_FAILURE;
-            } else {
-                if (match_base_name == current_snap_name)
-                    INFO( "most recent snapshot already present on remote" );
-                else {
-                    INFO( "sending partial backup..." );
-                    if (btrfs_transfer_snapshot_difference( snapshot_setup::snapshot_dir + match_base_name,
-                            snapshot_setup::snapshot_dir + current_snap_name,
-                            snapshot_setup::remote_snapshot_dir ))
-                        return EXIT_FAILURE;
-                }
-            }
+            vector<string> remote_expired, local_expired;
+            for (auto& path: planned)
+                (std::find( expired.begin(), expired.begin() + num_remote, path ) != expired.begin() + num_remote ?
+                 remote_expired : local_expired).push_back( path );
+            if (btrfs_delete_snapshots( setup, remote_expired, remote ) ||
+                    btrfs_delete_snapshots( setup, local_expired ))
+                cleanup_failed = true;
         }
 
-        INFO( "cleaning up..." );
-        for (unsigned i=snapshot_setup::keep_remote_snapshots_num-1; i<remote_snapshots.size(); ++i) {
-            if (btrfs_delete_snapshot( remote_snapshots[i] ))
-                return EXIT_FAILURE;
-        }
-        for (unsigned i=snapshot_setup::keep_snapshots_num; i<local_snapshots.size(); ++i) {
-            if (btrfs_delete_snapshot( local_snapshots[i] ))
-                return EXIT_FAILURE;
+        if (setup.checksum || setup.verify_interval) {
+            for (auto& entry: listed) {
+                vector<string> present;
+                for (auto& path: entry.second)
+                    if (std::find( planned.begin(), planned.end(), path ) == planned.end())
+                        present.push_back( path );
+                if (check_stream_sums( setup, remote, entry.first, present ))
+                    verify_failed = true;
+            }
         }
     }
 
-    if (snapshot_setup::do_sync)
-        if (btrfs_sync())
+    vector<string> touched = remote_dirs;
+    // the other host is synced right away, snap_finalize_sync() only
+    // reaches local file systems
+    if (setup.transport != "" && !remote_dirs.empty()) {
+        if (btrfs_sync( setup, remote_dirs, remote ))
+            return EXIT_FAILURE;
+        touched.clear();
+    }
+    touched.push_back( setup.snapshot_dir );
+    if (setup.do_sync) {
+        if (btrfs_sync( setup, touched ))
             return EXIT_FAILURE;
+    } else {
+        std::lock_guard<std::mutex> lock( unsynced_mutex );
+        unsynced.insert( unsynced.end(), touched.begin(), touched.end() );
+    }
 
-    if (snapshot_setup::post_command != "")
-        if (execute_post_command( snapshot_setup::post_command, current_snap_name ))
+    if (setup.post_command != "")
+        if (execute_post_command( setup, setup.post_command, current_snap_name ))
             return EXIT_FAILURE;
 
-    return EXIT_SUCCESS;
+    return cleanup_failed || verify_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+string base_name( string path ) {
+    while (path.size() > 1 && path.back() == '/')
+        path.pop_back();
+    return path.substr( path.rfind( '/' ) + 1 );
+}
+
+vector<string> snapshot_setup::remote_snapshot_dirs() const {
+    vector<string> dirs;
+    std::istringstream list( remote_snapshot_dir );
+    for (string dir; std::getline( list, dir, ',' ); ) {
+        dir.erase( 0, dir.find_first_not_of( " \t" ) );
+        dir.erase( dir.find_last_not_of( " \t" ) + 1 );
+        if (dir != "")
+            dirs.push_back( dir );
+    }
+    return dirs;
+}
+
+// largest snapshots per directory in the run report
+#define SPACE_HOLDERS 5
+
+// reads the space the snapshots (oldest first, all in the directory where
+// names for the log) pin and notes the largest holders for the run report.
+// with a budget, the oldest snapshots the policy keeps (but not those in
+// protect) are expired too until the exclusive bytes of the rest fit. data two snapshots share
+// counts for neither, so this is a lower bound of what they pin; what the
+// deletions make exclusive is seen by the next run.
+static vector<string> apply_space_budget( btrfs_backend* backend, string where,
+        const vector<string>& snapshots, vector<string> expired, const std::set<string>& protect,
+        unsigned long long budget ) {
+    vector<space_usage> usage;
+    if (snapshots.empty() || backend->get_space_usage( snapshots, usage )) {
+        if (budget && !snapshots.empty())
+            WARN( "space: exclusive sizes in " << where << " unknown (quotas disabled?), space budget not applied." );
+        return expired;
+    }
+
+    vector<size_t> largest;
+    unsigned long long total = 0;
+    for (size_t i=0; i<snapshots.size(); ++i) {
+        if (usage[i].known)
+            largest.push_back( i );
+        total += usage[i].exclusive;
+    }
+    size_t shown = std::min( largest.size(), (size_t)SPACE_HOLDERS );
+    std::partial_sort( largest.begin(), largest.begin() + shown, largest.end(),
+            [&]( size_t a, size_t b ){ return usage[a].exclusive > usage[b].exclusive; } );
+    largest.resize( shown );
+    if (!largest.empty())
+        INFO( "space: " << snapshots.size() << " snapshots in " << where << " hold " << format_bytes( total ) << " exclusively, most '" <<
+                base_name( snapshots[largest[0]] ) << "' (" << format_bytes( usage[largest[0]].exclusive ) << ")." );
+    if (current_metrics)
+        for (size_t i: largest)
+            current_metrics->space_holders.push_back( { snapshots[i], usage[i].exclusive, usage[i].referenced } );
+
+    if (!budget)
+        return expired;
+    std::set<string> gone( expired.begin(), expired.end() );
+    unsigned long long kept = 0;
+    for (size_t i=0; i<snapshots.size(); ++i)
+        if (!gone.count( snapshots[i] ))
+            kept += usage[i].exclusive;
+    for (size_t i=0; i<snapshots.size() && kept > budget; ++i) {
+        if (gone.count( snapshots[i] ) || protect.count( base_name( snapshots[i] ) ) || !usage[i].known)
+            continue;
+        INFO( "space budget: expiring '" << base_name( snapshots[i] ) << "' (" <<
+                format_bytes( usage[i].exclusive ) << " exclusive)." );
+        expired.push_back( snapshots[i] );
+        kept -= usage[i].exclusive;
+    }
+    if (kept > budget)
+        WARN( "space budget of " << format_bytes( budget ) << " exceeded by the snapshots that have to stay (" <<
+                format_bytes( kept ) << ")." );
+    return expired;
+}
+
+// local snapshots the retention policy does not keep. the current one and
+// those an unfinished transfer in the journal still needs as source or
+// parent stay.
+vector<string> expired_local( const snapshot_setup& setup, const vector<string>& local_snapshots,
+        string current_snap_name ) {
+    retention_policy policy;
+    policy.keep_last = setup.keep_snapshots_num;
+    policy.hourly = setup.keep_hourly;
+    policy.daily = setup.keep_daily;
+    policy.weekly = setup.keep_weekly;
+    policy.monthly = setup.keep_monthly;
+    std::set<string> needed;
+    for (auto& step: read_journal( journal_path( setup.snapshot_dir, setup.host_name + "_" + setup.backup_name ) )) {
+        needed.insert( step.name );
+        if (step.parent != "")
+            needed.insert( step.parent );
+    }
+    for (auto& path: plan_retention( local_snapshots, policy, { current_snap_name } ))
+        if (needed.count( base_name( path ) ))
+            INFO( "keeping '" << base_name( path ) << "', an unfinished transfer needs it." );
+    needed.insert( current_snap_name );
+    return apply_space_budget( get_backend( setup.backend ), "'" + setup.snapshot_dir + "'", local_snapshots,
+            plan_retention( local_snapshots, policy, needed ), needed, setup.space_budget );
+}
+
+// remote snapshots the remote retention policy does not keep. the newest one
+// is the parent of the next incremental and stays.
+vector<string> expired_remote( const snapshot_setup& setup, string dir,
+        const vector<string>& remote_snapshots, btrfs_backend* backend ) {
+    retention_policy policy;
+    policy.keep_last = setup.keep_remote_snapshots_num;
+    policy.hourly = setup.keep_remote_hourly;
+    policy.daily = setup.keep_remote_daily;
+    policy.weekly = setup.keep_remote_weekly;
+    policy.monthly = setup.keep_remote_monthly;
+    std::set<string> newest;
+    if (!remote_snapshots.empty())
+        newest.insert( base_name( remote_snapshots.back() ) );
+    string where = "'" + dir + "'" + (setup.transport != "" ? " (" + setup.transport + ")" : "");
+    return apply_space_budget( backend, where, remote_snapshots,
+            plan_retention( remote_snapshots, policy, newest ), newest, setup.remote_space_budget );
+}
+
+// cuts the deletion plan down to max_deletions snapshots and
+// max_deleted_bytes of exclusive data (by qgroup), oldest first. the rest
+// is left for the next runs so cleanup i/o does not spike. the first
+// num_remote paths of expired live on remote and are sized there.
+vector<string> apply_deletion_budget( const snapshot_setup& setup, const vector<string>& expired,
+        btrfs_backend* remote, size_t num_remote ) {
+    if (!setup.max_deletions && !setup.max_deleted_bytes)
+        return expired;
+    btrfs_backend* local = get_backend( setup.backend );
+    struct expired_snapshot {
+        time_t time;
+        string path;
+        btrfs_backend* backend;
+    };
+    vector<expired_snapshot> ordered;
+    for (size_t i=0; i<expired.size(); ++i) {
+        time_t time = 0;
+        snapshot_time( expired[i], time );
+        ordered.push_back( { time, expired[i], i < num_remote ? remote : local } );
+    }
+    std::stable_sort( ordered.begin(), ordered.end(),
+            []( const expired_snapshot& a, const expired_snapshot& b ){ return a.time < b.time; } );
+
+    vector<string> planned;
+    unsigned long long bytes = 0;
+    bool sizes_known = true;
+    for (auto& item: ordered) {
+        if (setup.max_deletions && planned.size() >= setup.max_deletions)
+            break;
+        unsigned long long referenced = 0, exclusive = 0;
+        if (setup.max_deleted_bytes && item.backend->get_qgroup_usage( item.path, referenced, exclusive ))
+            sizes_known = false;
+        // the first deletion always fits, or a large snapshot would stay forever
+        if (setup.max_deleted_bytes && !planned.empty() && bytes + exclusive > setup.max_deleted_bytes)
+            break;
+        bytes += exclusive;
+        planned.push_back( item.path );
+    }
+    if (setup.max_deleted_bytes && !sizes_known && !setup.dry_run)
+        WARN( "exclusive sizes unknown (quotas disabled?), max_deleted_bytes only counts what is known." );
+    if (planned.size() < expired.size())
+        INFO( "deletion budget: deleting " << planned.size() << " of " << expired.size() << " expired snapshots" <<
+                (setup.max_deleted_bytes ? " (" + format_bytes( bytes ) + " exclusive)" : string( "" )) <<
+                ", the rest next run." );
+    return planned;
+}
+
+// lists the snapshots in the target. a subvolume that is still writable was
+// left behind by an interrupted btrfs receive, as is the one the journal
+// had in flight when its state cannot be read; those go to partial instead.
+static void list_remote( const snapshot_setup& setup, remote_target& target, string in_flight,
+        vector<string>& partial ) {
+    string prefix = setup.host_name + "_" + setup.backup_name + "_";
+    if (setup.target == "archive") {
+        // unfinished archives keep their .partial name and never show up here
+        for (auto& a: list_archives( target.dir, prefix )) {
+            target.snapshots.emplace_back( a.name, a.uuid );
+            target.parents[a.name] = a.parent;
+        }
+        return;
+    }
+    btrfs_backend* backend = remote_backend( setup );
+    for (auto& path: backend->list_snapshots( target.dir, prefix )) {
+        subvolume_info info;
+        bool known = !backend->get_subvolume_info( path, info );
+        if (known ? !info.read_only : base_name( path ) == in_flight) {
+            partial.push_back( path );
+            continue;
+        }
+        target.snapshots.emplace_back( base_name( path ), known ? info.received_uuid : "" );
+    }
+}
+
+// whether name arrived completely in dir after a failed transfer
+static bool received_complete( const snapshot_setup& setup, string dir, string name ) {
+    if (setup.target == "archive") {
+        archive_manifest manifest;
+        return !read_manifest( archive_path( dir, name ), manifest );
+    }
+    subvolume_info info;
+    return !remote_backend( setup )->get_subvolume_info( dir + name, info ) &&
+        info.read_only && info.received_uuid != "";
+}
+
+// picks the parent among candidates (newest first) for sending the newest
+// local snapshot, -1 for a full send. candidates are ranked by the gap
+// between their ctransid and the current one; the first parent_probes of
+// them are probed with btrfs send --no-data and the smallest estimated
+// stream wins. estimates gets the estimate of the chosen parent.
+static long choose_parent( const snapshot_setup& setup, const vector<string>& local_snapshots,
+        const vector<bool>& candidates, std::map<long, unsigned long long>& estimates ) {
+    vector<long> ranked;
+    for (size_t i=0; i<candidates.size(); ++i)
+        if (candidates[i])
+            ranked.push_back( i );
+    if (ranked.empty())
+        return -1;
+
+    btrfs_backend* backend = get_backend( setup.backend );
+    subvolume_info current;
+    if (!backend->get_subvolume_info( local_snapshots[0], current )) {
+        std::unordered_map<long, unsigned long long> gap;
+        for (long i: ranked) {
+            subvolume_info info;
+            gap[i] = backend->get_subvolume_info( local_snapshots[i], info ) || info.ctransid > current.ctransid ?
+                ULLONG_MAX : current.ctransid - info.ctransid;
+        }
+        std::stable_sort( ranked.begin(), ranked.end(), [&]( long a, long b ){ return gap[a] < gap[b]; } );
+    }
+    if (ranked.size() > std::max( setup.parent_probes, 1u ))
+        ranked.resize( std::max( setup.parent_probes, 1u ) );
+    if (ranked.size() == 1 || setup.dry_run)
+        return ranked[0];
+
+    phase_timer timer( "probe" );
+    long best = -1;
+    for (long i: ranked) {
+        unsigned long long bytes;
+        if (probe_send_size( backend->send_command( { "btrfs", "send", "--no-data", "-p", local_snapshots[i],
+                        local_snapshots[0] } ), bytes ))
+            continue;
+        INFO( "parent '" << base_name( local_snapshots[i] ) << "': ~" << format_bytes( bytes ) << " to send" );
+        if (best < 0 || bytes < estimates[best]) {
+            best = i;
+            estimates[best] = bytes;
+        }
+    }
+    return best < 0 ? ranked[0] : best;
 }
 
-vector<string> glob_list( string expr ) {
-    glob_t G;
-    G.gl_offs = 10;
-    glob( expr.c_str(), GLOB_MARK | GLOB_NOCHECK, NULL, &G );
-    vector<string> result(G.gl_pathc);
-    for (size_t i=0; i<G.gl_pathc; ++i) {
-        result[i] = G.gl_pathv[i];
+// sends the current snapshot to every target that lacks it. all targets
+// are fed from a single btrfs send against the newest parent they share;
+// only targets without a shared parent get separate sends. with
+// transfer_chain every local snapshot newer than that parent is sent in
+// turn. the steps are kept in the journal until they are done, so a run
+// that dies halfway is cleaned up and continued by the next one.
+int transfer_to_remotes( const snapshot_setup& setup, const vector<string>& local_snapshots,
+        string current_snap_name, const vector<string>& remote_dirs ) {
+    btrfs_backend* backend = get_backend( setup.backend );
+    btrfs_backend* remote = remote_backend( setup );
+    phase_timer list_timer( "list" );
+    vector<string> local_uuids;
+    for (auto& path: local_snapshots) {
+        subvolume_info info;
+        local_uuids.push_back( backend->get_subvolume_info( path, info ) ? "" : info.uuid );
+    }
+    if (!setup.dry_run && std::all_of( local_uuids.begin(), local_uuids.end(),
+                []( const string& uuid ){ return uuid == ""; } ))
+        WARN( "cannot read subvolume info, matching snapshots by name." );
+
+    int result = EXIT_SUCCESS;
+    string journal = journal_path( setup.snapshot_dir, setup.host_name + "_" + setup.backup_name );
+    vector<journal_step> unfinished = read_journal( journal );
+    vector<remote_target> targets;
+    // targets whose journal entries are replaced by this run
+    vector<string> planned = remote_dirs;
+    for (auto& dir: remote_dirs) {
+        remote_target target;
+        target.dir = dir;
+        string in_flight = "";
+        for (auto& step: unfinished)
+            if (in_flight == "" && step.target == dir)
+                in_flight = step.name;
+        if (in_flight != "")
+            INFO( "last transfer to '" << dir << "' stopped at '" << in_flight << "', resuming." );
+
+        vector<string> partial;
+        list_remote( setup, target, in_flight, partial );
+        if (!partial.empty()) {
+            // removed right away, the next receive may reuse the name
+            vector<string> command = { "btrfs", "subvolume", "delete" };
+            command.insert( command.end(), partial.begin(), partial.end() );
+            WARN( "removing partial receive: " << command_string( command ) );
+            if (!setup.dry_run && remote->delete_snapshots( partial )) {
+                ERR( "cannot remove partial receive in '" << dir << "', skipping it." );
+                result = EXIT_FAILURE;
+                planned.erase( std::find( planned.begin(), planned.end(), dir ) );
+                continue;
+            }
+        }
+
+        bool present = false;
+        for (auto& remote: target.snapshots)
+            present = present || remote.first == current_snap_name;
+        if (present) {
+            INFO( "most recent snapshot already present on '" << dir << "'" );
+            continue;
+        }
+        mark_candidates( setup, local_snapshots, local_uuids, target );
+        targets.push_back( target );
+    }
+
+    list_timer.stop();
+
+    // cheapest parent shared by all targets, else group targets by their
+    // own cheapest parent (-1: full send). group_candidates holds what all
+    // targets of a group have, for clone sources.
+    std::map<long, vector<remote_target*>> groups;
+    std::map<long, vector<bool>> group_candidates;
+    std::map<long, unsigned long long> estimates;
+    vector<bool> shared( local_snapshots.size(), !targets.empty() );
+    for (auto& target: targets)
+        for (size_t i=0; i<local_snapshots.size(); ++i)
+            shared[i] = shared[i] && target.candidates[i];
+    bool any_shared = std::find( shared.begin(), shared.end(), true ) != shared.end();
+    long shared_parent = any_shared ? choose_parent( setup, local_snapshots, shared, estimates ) : -1;
+    for (auto& target: targets) {
+        long own = any_shared ? shared_parent : choose_parent( setup, local_snapshots, target.candidates, estimates );
+        auto& candidates = group_candidates.emplace( own, target.candidates ).first->second;
+        for (size_t i=0; i<local_snapshots.size(); ++i)
+            candidates[i] = candidates[i] && target.candidates[i];
+        groups[own].push_back( &target );
+    }
+
+    // (parent, snapshot) index pairs each group sends, oldest first
+    std::map<long, vector<pair<long,long>>> chains;
+    vector<journal_step> steps;
+    for (auto& group: groups) {
+        long parent = group.first;
+        for (long i = setup.transfer_chain && parent > 0 ? parent-1 : 0; i >= 0; parent = i--)
+            chains[group.first].emplace_back( parent, i );
+        for (auto& link: chains[group.first])
+            for (auto target: group.second)
+                steps.push_back( { target->dir, link.first < 0 ? "" : base_name( local_snapshots[link.first] ),
+                        base_name( local_snapshots[link.second] ) } );
+    }
+    if (!setup.dry_run && update_journal( journal, planned, steps ))
+        return EXIT_FAILURE;
+
+    for (auto& group: groups) {
+        vector<remote_target*> receiving = group.second;
+        for (auto& link: chains[group.first]) {
+            if (receiving.empty() || nokill_cancelled())
+                break;
+            string parent = link.first < 0 ? "" : base_name( local_snapshots[link.first] );
+            string snap_name = base_name( local_snapshots[link.second] );
+            string current = setup.snapshot_dir + snap_name;
+            string dirs = "";
+            for (auto target: receiving)
+                dirs += (dirs == "" ? "'" : ", '") + target->dir + "'";
+            if (parent == "")
+                INFO( "no matching snapshots, sending full snapshot to " << dirs << "..." );
+            else if (snap_name != current_snap_name)
+                INFO( "sending '" << snap_name << "' against '" << parent << "' to " << dirs << "..." );
+            else
+                INFO( "sending partial backup against '" << parent << "' to " << dirs << "..." );
+
+            // other snapshots all receivers hold let shared extents go
+            // across as clones. archives are restored along the parent
+            // chain only, so they cannot rely on them.
+            vector<string> args;
+            if (parent != "") {
+                args = { "-p", setup.snapshot_dir + parent };
+                unsigned clones = 0;
+                const vector<bool>& candidates = group_candidates[group.first];
+                for (size_t i=0; i<local_snapshots.size() && clones < setup.clone_sources &&
+                        setup.target != "archive"; ++i) {
+                    if (candidates[i] && (long)i != link.first) {
+                        args.push_back( "-c" );
+                        args.push_back( local_snapshots[i] );
+                        clones++;
+                    }
+                }
+            }
+            args.push_back( current );
+            vector<string> send = send_command( setup, args );
+            string receivers = "";
+            for (auto target: receiving)
+                receivers += (receivers == "" ? "" : ", ") + (setup.target == "archive" ?
+                        "> " + archive_path( target->dir, snap_name ) :
+                        pipeline_string( remote->receive_pipeline( target->dir ) ));
+            INFO( command_string( send ) << " | " << receivers );
+            if (setup.dry_run)
+                continue;
+
+            archive_manifest manifest;
+            manifest.name = snap_name;
+            manifest.parent = parent;
+            subvolume_info info;
+            if (!backend->get_subvolume_info( current, info ))
+                manifest.uuid = info.uuid;
+            if (parent != "" && !backend->get_subvolume_info( setup.snapshot_dir + parent, info ))
+                manifest.parent_uuid = info.uuid;
+
+            vector<std::unique_ptr<stream_sink>> sinks;
+            vector<stream_sink*> sink_ptrs;
+            for (auto target: receiving) {
+                if (setup.target == "archive")
+                    sinks.emplace_back( new archive_sink( archive_path( target->dir, snap_name ), manifest,
+                                setup.archive_chunk_size, setup.archive_compression_level, setup.archive_threads ) );
+                else
+                    sinks.emplace_back( remote->receive_sink( target->dir, snap_name ) );
+                sink_ptrs.push_back( sinks.back().get() );
+            }
+
+            transfer_options options = make_transfer_options( setup );
+            options.checksum = setup.checksum && setup.target != "archive";
+            // a full stream is at most as large as the data used on the source,
+            // good enough for a rough ETA.
+            struct statvfs fs;
+            if (parent == "" && statvfs( current.c_str(), &fs ) == 0)
+                options.expected_bytes = (unsigned long long)(fs.f_blocks - fs.f_bfree) * fs.f_frsize;
+            phase_timer timer( "transfer" );
+            transfer_stats stats;
+            int transferred = transfer_to_sinks( send, sink_ptrs, options, &stats );
+            timer.add_bytes( stats.bytes );
+            if (link.first == group.first && estimates.count( group.first ))
+                INFO( "transfer: estimated " << format_bytes( estimates[group.first] ) << ", sent " <<
+                        format_bytes( stats.bytes ) << "." );
+            if (transferred) {
+                // targets that missed this step cannot take the rest of the
+                // chain; their steps stay in the journal for the next run.
+                result = EXIT_FAILURE;
+                vector<remote_target*> missed;
+                for (auto target: receiving)
+                    if (!received_complete( setup, target->dir, snap_name ))
+                        missed.push_back( target );
+                receiving.erase( std::remove_if( receiving.begin(), receiving.end(), [&]( remote_target* t ){
+                            return std::find( missed.begin(), missed.end(), t ) != missed.end(); } ),
+                        receiving.end() );
+                // a cancelled run does not leave the half received
+                // subvolume to the next one
+                for (auto target: missed) {
+                    string path = target->dir + snap_name;
+                    if (nokill_cancelled() && setup.target != "archive" && remote->directory_exists( path )) {
+                        WARN( "removing partial receive: " << command_string(
+                                    { "btrfs", "subvolume", "delete", path } ) );
+                        remote->delete_snapshot( path );
+                    }
+                }
+            }
+
+            vector<string> done;
+            for (auto target: receiving)
+                done.push_back( target->dir );
+            if (options.checksum && !done.empty()) {
+                INFO( "transfer: crc32c " << std::hex << std::setw( 8 ) << std::setfill( '0' ) << stats.crc32c <<
+                        std::dec << " of " << stats.bytes << " bytes." );
+                stream_sum sum;
+                sum.name = snap_name;
+                sum.parent = parent;
+                sum.crc = stats.crc32c;
+                sum.bytes = stats.bytes;
+                for (auto& dir: done)
+                    if (record_stream_sum( remote, dir, setup.host_name + "_" + setup.backup_name + "_", sum ))
+                        result = EXIT_FAILURE;
+            }
+            for (auto step = steps.begin(); step != steps.end(); )
+                step = step->name == snap_name && std::find( done.begin(), done.end(), step->target ) != done.end() ?
+                    steps.erase( step ) : step + 1;
+            vector<journal_step> remaining;
+            for (auto& step: steps)
+                if (std::find( done.begin(), done.end(), step.target ) != done.end())
+                    remaining.push_back( step );
+            if (update_journal( journal, done, remaining ))
+                result = EXIT_FAILURE;
+        }
     }
-    globfree( &G );
     return result;
 }
 
@@ -199,34 +786,22 @@ int has_dir( string pathname ) {
         return 1;
 }
 
-string tempfile() {
-    char tmpnam[PATH_MAX];
-    std::tmpnam( tmpnam );
-    return tmpnam;
+// user commands are shell code and run through sh. values we hand them go
+// in environment variables (NAME=value), which need no quoting.
+int execute( string command, const vector<string>& variables ) {
+    if (variables.empty())
+        return run_process( { "/bin/sh", "-c", command } );
+    vector<string> env;
+    for (char** e = environ; *e; ++e)
+        env.push_back( *e );
+    env.insert( env.end(), variables.begin(), variables.end() );
+    return run_process( { "/bin/sh", "-c", command }, &env );
 }
 
-int execute( string command ) {
-    string fname = tempfile();
-    command = "trap '' SIGINT; " + command + " 2>&1 > '" + fname + "'";
-    pid_t other = fork();
-    if (!other) {
-        signal(SIGINT, nokill_handler);
-        execl("/bin/sh", "sh", "-c", command.c_str(), (char*) NULL);
-    }
-    int result = 0;
-    waitpid( other, &result, 0 );
-    std::ifstream ftmp( fname );
-    for (string line; std::getline(ftmp, line); ) {
-        SHELL( line );
-    }
-    ftmp.close();
-    remove( fname.c_str() );
-    return result;
-}
-
-int execute_pre_command( string command ) {
+int execute_pre_command( const snapshot_setup& setup, string command ) {
+    phase_timer timer( "pre_command" );
     INFO( command );
-    if (snapshot_setup::dry_run) return 0;
+    if (setup.dry_run) return 0;
     return execute( command );
 }
 
@@ -239,50 +814,106 @@ static string ReplaceString(string subject, const string& search, const string&
     return subject;
 }
 
-int execute_post_command( string command_, string snapshot_name ) {
+int execute_post_command( const snapshot_setup& setup, string command_, string snapshot_name ) {
+    phase_timer timer( "post_command" );
     string command = ReplaceString( command_, "%SNAPSHOT%", snapshot_name );
     INFO( command );
-    if (snapshot_setup::dry_run) return 0;
-    return execute( command );
+    if (setup.dry_run) return 0;
+    return execute( command, { "BTRFS_SNAP_SNAPSHOT=" + snapshot_name,
+            "BTRFS_SNAP_SNAPSHOT_DIR=" + setup.snapshot_dir } );
 }
 
-int btrfs_create_snapshot( string backup_dir, string name ) {
-    string command = "btrfs subvolume snapshot -r '";
-    command += backup_dir + "' '" + name + "'";
-    INFO( command );
-    if (snapshot_setup::dry_run) return 0;
-    return execute( command );
+int btrfs_create_snapshot( const snapshot_setup& setup, string backup_dir, string name ) {
+    phase_timer timer( "create" );
+    INFO( command_string( { "btrfs", "subvolume", "snapshot", "-r", backup_dir, name } ) <<
+            " (" << setup.backend << ")" );
+    if (setup.dry_run) return 0;
+    return get_backend( setup.backend )->create_snapshot( backup_dir, name, true );
 }
 
-int btrfs_transfer_snapshot_difference( string prev_name, string name, string out_dir ) {
-    string command = "btrfs send -p '";
-    command += prev_name + "' '" + name + "' 2>/dev/null | btrfs receive '" + out_dir + "'";
-    INFO( command );
-    if (snapshot_setup::dry_run) return 0;
-    return execute( command );
+// taking a snapshot copies the source root in the snapshot's transaction,
+// so the generation of the source only moves past the snapshot's otransid
+// once something is written to it. newest gets the name of the snapshot.
+bool source_unchanged( const snapshot_setup& setup, string& newest ) {
+    vector<string> local_snapshots = snapshot_paths( setup.snapshot_dir,
+            setup.host_name + "_" + setup.backup_name + "_" );
+    if (local_snapshots.empty())
+        return false;
+    btrfs_backend* backend = get_backend( setup.backend );
+    subvolume_info source, snapshot;
+    if (backend->get_subvolume_info( setup.backup_dir, source ) ||
+            backend->get_subvolume_info( local_snapshots.back(), snapshot ) || !snapshot.otransid)
+        return false;
+    // a snapshot of another subvolume, e.g. after backup_dir was restored
+    if (snapshot.parent_uuid != "" && snapshot.parent_uuid != source.uuid)
+        return false;
+    newest = base_name( local_snapshots.back() );
+    return source.generation == snapshot.otransid;
 }
 
-int btrfs_transfer_full_snapshot( string name, string out_dir ) {
-    string command = "btrfs send '";
-    command += name + "' 2>/dev/null | btrfs receive '" + out_dir + "'";
-    INFO( command );
-    if (snapshot_setup::dry_run) return 0;
-    return execute( command );
+static bool use_compressed_data( const snapshot_setup& setup ) {
+    if (setup.compressed_data == "true")
+        return true;
+    if (setup.compressed_data == "false" || setup.backend == "mock")
+        return false;
+    return detect_send_features().compressed_data();
 }
 
-int btrfs_delete_snapshot( string name ) {
-    string command = "btrfs subvolume delete '";
-    command += name + "'";
-    INFO( command );
-    if (snapshot_setup::dry_run) return 0;
-    return execute( command );
+// btrfs send with protocol v2 passes compressed extents through as they
+// are instead of decompressing them for the stream.
+vector<string> send_command( const snapshot_setup& setup, const vector<string>& args ) {
+    vector<string> command = { "btrfs", "send" };
+    if (use_compressed_data( setup )) {
+        command.push_back( "--proto" );
+        command.push_back( "2" );
+        command.push_back( "--compressed-data" );
+    }
+    command.insert( command.end(), args.begin(), args.end() );
+    return get_backend( setup.backend )->send_command( command );
 }
 
-int btrfs_sync() {
-    string command = "sync";
-    INFO( command );
-    if (snapshot_setup::dry_run) return 0;
-    return execute( command );
+transfer_options make_transfer_options( const snapshot_setup& setup ) {
+    transfer_options options;
+    options.buffer_size = setup.buffer_size;
+    options.progress_interval = setup.progress_interval;
+    options.protocol = use_compressed_data( setup ) ? "v2, compressed data" : "v1";
+    options.bandwidth.default_rate = setup.bandwidth_limit;
+    options.bandwidth.parse( setup.bandwidth_schedule );
+    return options;
+}
+
+int btrfs_delete_snapshots( const snapshot_setup& setup, const vector<string>& names,
+        btrfs_backend* backend ) {
+    if (names.empty()) return 0;
+    vector<string> command = { "btrfs", "subvolume", "delete" };
+    command.insert( command.end(), names.begin(), names.end() );
+    INFO( command_string( command ) << " (" << (backend ? backend->name() : setup.backend) <<
+            (setup.async_cleanup ? ", background" : "") << ")" );
+    if (setup.dry_run) return 0;
+    // queued deletions are timed by the cleanup thread
+    if (setup.async_cleanup)
+        return cleanup_snapshots( setup, names, backend );
+    phase_timer timer( "delete" );
+    return cleanup_snapshots( setup, names, backend );
+}
+
+// only the file systems a run wrote to are synced, not every mount
+int btrfs_sync( const snapshot_setup& setup, const vector<string>& paths, btrfs_backend* backend ) {
+    phase_timer timer( "sync" );
+    vector<string> command = { "sync", "-f" };
+    command.insert( command.end(), paths.begin(), paths.end() );
+    INFO( command_string( command ) << (backend ? " (" + backend->name() + ")" : string( "" )) );
+    if (setup.dry_run) return 0;
+    return (backend ? backend : get_backend( setup.backend ))->sync_paths( paths );
+}
+
+// the backend that reaches the remote snapshot dirs: the local one, or
+// the transport to another host. NULL if the transport is misconfigured.
+btrfs_backend* remote_backend( const snapshot_setup& setup ) {
+    if (setup.transport == "")
+        return get_backend( setup.backend );
+    return get_transport_backend( setup.transport, setup.transport_compression,
+            setup.transport_compression_level );
 }
 
 string date_now() {
@@ -294,42 +925,42 @@ string date_now() {
     return buf;
 }
 
-bool has_root_priv() {
-    if (snapshot_setup::dry_run) return true;
+bool has_root_priv( const snapshot_setup& setup ) {
+    if (setup.dry_run || setup.backend == "mock") return true;
     return !geteuid();
 }
 
-int setup_variables_saved( string name ) {
+int setup_variables_saved( snapshot_setup& setup, string name ) {
     if (name == "home") {
-        snapshot_setup::backup_name = "home";
-        snapshot_setup::backup_dir = "/home/";
+        setup.backup_name = "home";
+        setup.backup_dir = "/home/";
     } else if (name == "root") {
-        snapshot_setup::backup_name = "root";
-        snapshot_setup::backup_dir = "/";
+        setup.backup_name = "root";
+        setup.backup_dir = "/";
     } else if (name == "sirwer_home") {
-        snapshot_setup::backup_name = "home";
-        snapshot_setup::backup_dir = "/mnt/btrfs_discs/hdd/subvol_home/";
-        snapshot_setup::host_name = "sirwer";
-        snapshot_setup::transfer = false;
-        snapshot_setup::snapshot_dir = "/.snapshots_data/";
+        setup.backup_name = "home";
+        setup.backup_dir = "/mnt/btrfs_discs/hdd/subvol_home/";
+        setup.host_name = "sirwer";
+        setup.transfer = false;
+        setup.snapshot_dir = "/.snapshots_data/";
     } else if (name == "sirwer_root") {
-        snapshot_setup::backup_name = "root";
-        snapshot_setup::backup_dir = "/";
-        snapshot_setup::host_name = "sirwer";
-        snapshot_setup::snapshot_dir = "/.snapshots/";
-        snapshot_setup::remote_snapshot_dir = "/mnt/btrfs_discs/hdd/backup_ssd/";
-        snapshot_setup::keep_snapshots_num = 1;
-        snapshot_setup::pre_command = "tar -P -f /boot.tar.gz -z -c /mnt/btrfs_discs/ssd/boot";
+        setup.backup_name = "root";
+        setup.backup_dir = "/";
+        setup.host_name = "sirwer";
+        setup.snapshot_dir = "/.snapshots/";
+        setup.remote_snapshot_dir = "/mnt/btrfs_discs/hdd/backup_ssd/";
+        setup.keep_snapshots_num = 1;
+        setup.pre_command = "tar -P -f /boot.tar.gz -z -c /mnt/btrfs_discs/ssd/boot";
     } else if (name == "home_hdd") {
-        snapshot_setup::backup_name = "home";
-        snapshot_setup::backup_dir = "/home/";
-        snapshot_setup::remote_snapshot_dir = "/mnt/backup-hdd/snapshots/";
-        snapshot_setup::keep_remote_snapshots_num = 3;
+        setup.backup_name = "home";
+        setup.backup_dir = "/home/";
+        setup.remote_snapshot_dir = "/mnt/backup-hdd/snapshots/";
+        setup.keep_remote_snapshots_num = 3;
     } else if (name == "root_hdd") {
-        snapshot_setup::backup_name = "root";
-        snapshot_setup::backup_dir = "/";
-        snapshot_setup::remote_snapshot_dir = "/mnt/backup-hdd/snapshots/";
-        snapshot_setup::keep_remote_snapshots_num = 3;
+        setup.backup_name = "root";
+        setup.backup_dir = "/";
+        setup.remote_snapshot_dir = "/mnt/backup-hdd/snapshots/";
+        setup.keep_remote_snapshots_num = 3;
     } else {
         ERR( "pre-saved mode can be 'home', 'root', 'sirwer_home', 'sirwer_root', 'root_hdd', 'home_hdd'" );
         return EXIT_FAILURE;
@@ -337,6 +968,11 @@ int setup_variables_saved( string name ) {
     return EXIT_SUCCESS;
 }
 
-int snap_finalize_sync() {
-    return btrfs_sync();
+int snap_finalize_sync( const snapshot_setup& setup ) {
+    std::lock_guard<std::mutex> lock( unsynced_mutex );
+    if (unsynced.empty())
+        return EXIT_SUCCESS;
+    int result = btrfs_sync( setup, unsynced );
+    unsynced.clear();
+    return result;
 }
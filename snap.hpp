@@ -1,28 +1,113 @@
+#pragma once
+
 #include <string>
 #include <iostream>
+#include <sstream>
+#include <vector>
 
 using std::string;
+using std::vector;
 
 class snapshot_setup {
     public:
-        static string host_name;
-        static string backup_name;
-        static string backup_dir;
-        static string snapshot_dir;
-        static string remote_snapshot_dir;
-        static unsigned keep_remote_snapshots_num;
-        static unsigned keep_snapshots_num;
-        static bool dry_run;
-        static string pre_command;
-        static string post_command;
-        static bool transfer;
-        static bool create;
-        static bool do_sync;
+        string host_name = "cygnus";
+        string backup_name = "home";
+        string backup_dir = "/home/";
+        string snapshot_dir = "/.snapshots/";
+        string remote_snapshot_dir = "/mnt/backup-mypass/snapshots/";
+        unsigned keep_remote_snapshots_num = 10;
+        unsigned keep_snapshots_num = 10;
+        bool dry_run = false;
+        string pre_command = "";
+        string post_command = "";
+        bool transfer = true;
+        bool create = true;
+        // no new snapshot (and so nothing to send) while backup_dir has not
+        // changed since the newest one
+        bool skip_unchanged = true;
+        bool do_sync = true;
+        size_t buffer_size = 256ul << 20;
+        unsigned progress_interval = 10;
+        string backend = "auto";
+        bool async_cleanup = false;
+        unsigned cleaner_max_pending = 2;
+        string compressed_data = "auto";
+        string target = "btrfs";
+        size_t archive_chunk_size = 64ul << 20;
+        int archive_compression_level = 3;
+        unsigned archive_threads = 0;
+        unsigned archive_full_every = 10;
+        // send every local snapshot newer than the common parent instead
+        // of only the newest one
+        bool transfer_chain = false;
+        // io priority ("none", "realtime", "best-effort" or "idle" with
+        // level 0-7) and nice increment of the section and its processes
+        string io_class = "none";
+        int io_level = 4;
+        int nice = 0;
+        // send stream limit in bytes/s (0: none), overridden during the
+        // windows of bandwidth_schedule ("08:00-18:00=20M, ...")
+        size_t bandwidth_limit = 0;
+        string bandwidth_schedule = "";
+        // daemon mode: seconds between runs (0: not scheduled) and the
+        // shift of the runs against local midnight
+        unsigned interval = 0;
+        unsigned interval_offset = 0;
+        // candidate parents probed with btrfs send --no-data for the
+        // smallest delta (1: newest only) and snapshots the receivers hold
+        // passed as clone sources (-c)
+        unsigned parent_probes = 3;
+        unsigned clone_sources = 2;
+        // besides the newest keep_(remote_)snapshots_num, keep the newest
+        // snapshot of that many hours/days/weeks/months
+        unsigned keep_hourly = 0, keep_daily = 0, keep_weekly = 0, keep_monthly = 0;
+        unsigned keep_remote_hourly = 0, keep_remote_daily = 0, keep_remote_weekly = 0,
+                 keep_remote_monthly = 0;
+        // per-run cap on deletions and on the exclusive bytes they free
+        // (0: unlimited); the rest is deleted by later runs
+        unsigned max_deletions = 0;
+        size_t max_deleted_bytes = 0;
+        // exclusive bytes (by qgroup) the snapshots of the snapshot dir and
+        // of each remote dir may pin (0: unlimited); the oldest ones beyond
+        // are expired although the policy keeps them
+        size_t space_budget = 0;
+        size_t remote_space_budget = 0;
+        // backend = mock: milliseconds each operation takes and the size of
+        // the simulated send streams
+        unsigned mock_latency = 0;
+        size_t mock_stream_size = 1ul << 20;
+        // command that runs a shell command line on the host of
+        // remote_snapshot_dir ("": the dirs are local), and the compression
+        // ("none", "zstd" or "lz4") and level of the streams it carries
+        string transport = "";
+        string transport_compression = "none";
+        int transport_compression_level = 3;
+        // crc32c of every send stream, recorded next to the remote snapshot,
+        // and seconds between verifications of a remote snapshot by sending
+        // it on the receiving side (0: never)
+        bool checksum = true;
+        unsigned verify_interval = 0;
+
+        // remote_snapshot_dir may list several directories separated by
+        // commas; one send stream is fanned out to all of them.
+        vector<string> remote_snapshot_dirs() const;
 };
 
-int snap_and_transfer();
-int setup_variables_saved( string name );
-int snap_finalize_sync();
+int snap_and_transfer( const snapshot_setup& setup );
+// the two halves of snap_and_transfer(): checks, pre_command and creation
+// of the snapshot named current_snap_name, then listing, transfer, cleanup,
+// sync and post_command. they may run on different threads.
+int snap_create( const snapshot_setup& setup, string& current_snap_name );
+int snap_transfer( const snapshot_setup& setup, string current_snap_name );
+int setup_variables_saved( snapshot_setup& setup, string name );
+int snap_finalize_sync( const snapshot_setup& setup );
+
+// last path component, without trailing slashes
+string base_name( string path );
+
+// tag prepended to every log line of the current thread, e.g. the config
+// section a job runs for. empty for the main thread.
+extern thread_local string log_tag;
 
 static const char _colors_black[] = "\u001b[30m";
 static const char _colors_red[] = "\u001b[31m";
@@ -43,9 +128,19 @@ static const char _colors_bright_white[] = "\u001b[37;1m";
 static const char _colors_reset[] = "\u001b[0m";
 #define COLOR( str, name ) _colors_##name << str << _colors_reset
 
-#define WARN( str )  std::cerr << COLOR( "warning: ", bright_yellow  ) << str << std::endl
-#define ERR( str )   std::cerr << COLOR( "error: ",   bright_red     ) << str << std::endl
-#define INFO( str )  std::cerr << COLOR( "info: ",    bright_blue    ) << str << std::endl
-#define SHELL( str ) std::cerr << COLOR( "shell: ",   bright_green   ) << str << std::endl
-#define CFG( str )   std::cerr << COLOR( "cfg: ",     bright_magenta ) << str << std::endl
+// each line is formatted first and written with a single insertion so that
+// lines of concurrently running jobs do not interleave.
+#define LOG_LINE( prefix, msg ) do { \
+        std::ostringstream _log_line; \
+        _log_line << prefix; \
+        if (!log_tag.empty()) _log_line << "[" << log_tag << "] "; \
+        _log_line << msg << "\n"; \
+        std::cerr << _log_line.str() << std::flush; \
+    } while (0)
+
+#define WARN( str )  LOG_LINE( COLOR( "warning: ", bright_yellow  ), str )
+#define ERR( str )   LOG_LINE( COLOR( "error: ",   bright_red     ), str )
+#define INFO( str )  LOG_LINE( COLOR( "info: ",    bright_blue    ), str )
+#define SHELL( str ) LOG_LINE( COLOR( "shell: ",   bright_green   ), str )
+#define CFG( str )   LOG_LINE( COLOR( "cfg: ",     bright_magenta ), str )
 
@@ -0,0 +1,177 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "throttle.hpp"
+#include "config.hpp"
+#include "snap.hpp"
+#include "transfer.hpp"
+
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+// not exported by glibc, see linux/ioprio.h
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+static int parse_clock( string s, unsigned& minutes ) {
+    unsigned h, m;
+    char rest;
+    if (sscanf( s.c_str(), "%u:%u%c", &h, &m, &rest ) != 2 || h > 24 || m > 59 || (h == 24 && m))
+        return EXIT_FAILURE;
+    minutes = (h * 60 + m) % (24 * 60);
+    return EXIT_SUCCESS;
+}
+
+int bandwidth_schedule::parse( string spec ) {
+    windows.clear();
+    std::istringstream list( spec );
+    for (string item; std::getline( list, item, ',' ); ) {
+        item.erase( 0, item.find_first_not_of( " \t" ) );
+        item.erase( item.find_last_not_of( " \t" ) + 1 );
+        if (item == "")
+            continue;
+        size_t dash = item.find( '-' ), eq = item.find( '=' );
+        window w;
+        if (dash == string::npos || eq == string::npos || eq < dash ||
+                parse_clock( item.substr( 0, dash ), w.start ) ||
+                parse_clock( item.substr( dash+1, eq-dash-1 ), w.end ) || eq+1 == item.size()) {
+            ERR( "bandwidth_schedule: cannot parse '" << item << "', expected HH:MM-HH:MM=<rate>." );
+            return EXIT_FAILURE;
+        }
+        try {
+            w.rate = parse_size( item.substr( eq+1 ) );
+        } catch (const std::exception&) {
+            ERR( "bandwidth_schedule: '" << item.substr( eq+1 ) << "' is not a rate." );
+            return EXIT_FAILURE;
+        }
+        windows.push_back( w );
+    }
+    return EXIT_SUCCESS;
+}
+
+unsigned long long bandwidth_schedule::rate_at( time_t now ) const {
+    struct tm local;
+    localtime_r( &now, &local );
+    unsigned minute = local.tm_hour * 60 + local.tm_min;
+    for (auto& w: windows) {
+        bool inside = w.start <= w.end ? (minute >= w.start && minute < w.end) :
+            (minute >= w.start || minute < w.end);
+        if (inside)
+            return w.rate;
+    }
+    return default_rate;
+}
+
+bool bandwidth_schedule::unlimited() const {
+    return !default_rate && std::all_of( windows.begin(), windows.end(),
+            []( const window& w ){ return w.rate == 0; } );
+}
+
+token_bucket::token_bucket( const bandwidth_schedule& schedule_ ):
+    schedule( schedule_ ), last( clock_type::now() ) {
+    update_rate();
+}
+
+void token_bucket::update_rate() {
+    time_t now = time( NULL );
+    if (rate_checked && now - rate_checked < 10)
+        return;
+    rate_checked = now;
+    unsigned long long new_rate = schedule.rate_at( now );
+    if (new_rate != rate)
+        INFO( "transfer: bandwidth limit " << (new_rate ? format_bytes( new_rate ) + "/s" : string( "off" )) << "." );
+    rate = new_rate;
+}
+
+size_t token_bucket::chunk( size_t max ) const {
+    if (!rate)
+        return max;
+    return std::max( (size_t)4096, std::min( max, (size_t)(rate / 10) ) );
+}
+
+void token_bucket::consume( size_t bytes ) {
+    update_rate();
+    auto now = clock_type::now();
+    if (!rate) {
+        tokens = 0.0;
+        last = now;
+        return;
+    }
+    // refill, holding at most a tenth of a second worth of tokens
+    tokens = std::min( tokens + std::chrono::duration<double>( now - last ).count() * rate, rate / 10.0 );
+    last = now;
+    tokens -= bytes;
+    if (tokens < 0.0)
+        std::this_thread::sleep_for( std::chrono::duration<double>( -tokens / rate ) );
+}
+
+int apply_priorities( const snapshot_setup& setup ) {
+    // nice is an increment, so a thread must not apply it twice
+    static thread_local bool applied = false;
+    if (applied)
+        return EXIT_SUCCESS;
+    applied = true;
+    pid_t tid = syscall( SYS_gettid );
+    if (setup.io_class != "none") {
+        int io_class = setup.io_class == "realtime" ? IOPRIO_CLASS_RT :
+            setup.io_class == "best-effort" ? IOPRIO_CLASS_BE : IOPRIO_CLASS_IDLE;
+        int level = io_class == IOPRIO_CLASS_IDLE ? 0 : setup.io_level;
+        INFO( "ionice -c " << io_class << (io_class == IOPRIO_CLASS_IDLE ? "" : " -n " + std::to_string( level )) );
+        if (!setup.dry_run && syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid,
+                    (io_class << IOPRIO_CLASS_SHIFT) | level )) {
+            ERR( "cannot set io priority: " << strerror( errno ) );
+            return EXIT_FAILURE;
+        }
+    }
+    if (setup.nice) {
+        INFO( "nice -n " << setup.nice );
+        errno = 0;
+        int current = getpriority( PRIO_PROCESS, tid );
+        if (!setup.dry_run && ((current == -1 && errno) ||
+                    setpriority( PRIO_PROCESS, tid, current + setup.nice ))) {
+            ERR( "cannot change nice value: " << strerror( errno ) );
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+thread_priorities current_priorities() {
+    thread_priorities priorities;
+    pid_t tid = syscall( SYS_gettid );
+    priorities.ioprio = syscall( SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid );
+    errno = 0;
+    int nice = getpriority( PRIO_PROCESS, tid );
+    if (nice != -1 || !errno)
+        priorities.nice = nice;
+    return priorities;
+}
+
+int set_priorities( const thread_priorities& priorities ) {
+    pid_t tid = syscall( SYS_gettid );
+    if (priorities.ioprio >= 0 && syscall( SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid ) != priorities.ioprio &&
+            syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, priorities.ioprio )) {
+        ERR( "cannot set io priority: " << strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    errno = 0;
+    int current = getpriority( PRIO_PROCESS, tid );
+    if ((current != -1 || !errno) && current != priorities.nice &&
+            setpriority( PRIO_PROCESS, tid, priorities.nice )) {
+        ERR( "cannot change nice value: " << strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
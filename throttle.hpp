@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ctime>
+
+using std::string;
+using std::vector;
+
+class snapshot_setup;
+
+// bandwidth limit in bytes per second that changes with the local time of
+// day, e.g. "08:00-18:00=20M, 18:00-08:00=0". windows may wrap around
+// midnight, 0 means unlimited and times outside every window use
+// default_rate.
+class bandwidth_schedule {
+    public:
+        unsigned long long default_rate = 0;
+        // EXIT_FAILURE on a malformed spec
+        int parse( string spec );
+        unsigned long long rate_at( time_t now ) const;
+        bool unlimited() const;
+    private:
+        struct window {
+            unsigned start, end; // minutes since midnight
+            unsigned long long rate;
+        };
+        vector<window> windows;
+};
+
+// limits a byte stream to the rate of a schedule. at most a tenth of a
+// second worth of bytes passes at once, so low limits do not turn into
+// long bursts and pauses.
+class token_bucket {
+    public:
+        token_bucket( const bandwidth_schedule& schedule );
+        // largest read that should be done next
+        size_t chunk( size_t max ) const;
+        // accounts for bytes that passed, sleeping while over the limit
+        void consume( size_t bytes );
+    private:
+        using clock_type = std::chrono::steady_clock;
+        void update_rate();
+        const bandwidth_schedule& schedule;
+        unsigned long long rate = 0;
+        time_t rate_checked = 0;
+        double tokens = 0.0;
+        clock_type::time_point last;
+};
+
+// applies io_class/io_level and nice of setup to the calling thread. the
+// processes and threads it starts afterwards inherit both. only the first
+// call on a thread has an effect.
+int apply_priorities( const snapshot_setup& setup );
+
+// io priority and nice value of a thread, to carry the priorities of a
+// section over to work another thread does for it
+struct thread_priorities {
+    int ioprio = -1; // -1: unknown, left as it is
+    int nice = 0;
+};
+
+// those of the calling thread
+thread_priorities current_priorities();
+
+// sets priorities on the calling thread, absolute instead of as increment
+int set_priorities( const thread_priorities& priorities );
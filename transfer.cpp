@@ -0,0 +1,499 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "transfer.hpp"
+#include "proc.hpp"
+#include "snap.hpp"
+#include "checksum.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <endian.h>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define PIPE_SIZE (1 << 20)
+#define IO_CHUNK (1 << 20)
+
+using clock_type = std::chrono::steady_clock;
+
+string format_bytes( unsigned long long bytes ) {
+    const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double value = bytes;
+    unsigned unit = 0;
+    while (value >= 1024.0 && unit < 4) {
+        value /= 1024.0;
+        unit++;
+    }
+    char buf[64];
+    snprintf( buf, sizeof(buf), unit ? "%.1f %s" : "%.0f %s", value, units[unit] );
+    return buf;
+}
+
+static string format_duration( double seconds ) {
+    unsigned long s = seconds + 0.5;
+    char buf[64];
+    snprintf( buf, sizeof(buf), "%lu:%02lu:%02lu", s/3600, (s/60)%60, s%60 );
+    return buf;
+}
+
+// byte ring with one producer and one consumer per receiver. the reader
+// thread owns the free region, each writer thread the part of the filled
+// one it has not passed on yet; only the counters are shared. receivers
+// move at their own pace, at most size bytes apart.
+class ring_buffer {
+    public:
+        ring_buffer( size_t size_, size_t receivers ): size( size_ ), data( new char[size_] ),
+            offsets( receivers, 0 ), alive( receivers, true ) {}
+
+        // the slowest receiver still alive frees the space behind it
+        void update_tail() {
+            unsigned long long slowest = head;
+            for (size_t i=0; i<offsets.size(); ++i)
+                if (alive[i])
+                    slowest = std::min( slowest, offsets[i] );
+            tail = slowest;
+        }
+
+        std::mutex mutex;
+        std::condition_variable changed;
+        const size_t size;
+        std::unique_ptr<char[]> data;
+        unsigned long long head = 0; // bytes read from the sender
+        unsigned long long tail = 0; // bytes written to every receiver
+        vector<unsigned long long> offsets; // bytes written to each receiver
+        vector<bool> alive;
+        bool eof = false;
+        bool aborted = false;
+};
+
+// crc (if set) is updated with every chunk as it is read.
+static void fill_thread( ring_buffer& ring, int in, token_bucket* bucket, uint32_t* crc ) {
+    for (;;) {
+        size_t pos, len;
+        {
+            std::unique_lock<std::mutex> lock( ring.mutex );
+            ring.changed.wait( lock, [&](){ return ring.head - ring.tail < ring.size || ring.aborted; } );
+            if (ring.aborted)
+                break;
+            pos = ring.head % ring.size;
+            len = std::min( { ring.size - pos, (size_t)(ring.size - (ring.head - ring.tail)),
+                    (size_t)IO_CHUNK } );
+        }
+        if (bucket)
+            len = bucket->chunk( len );
+        ssize_t n = read( in, ring.data.get() + pos, len );
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (bucket && n > 0)
+            bucket->consume( n );
+        if (crc && n > 0)
+            *crc = crc32c( *crc, ring.data.get() + pos, n );
+        std::lock_guard<std::mutex> lock( ring.mutex );
+        if (n <= 0) {
+            ring.eof = true;
+            if (n < 0)
+                ring.aborted = true;
+        } else {
+            ring.head += n;
+            ring.update_tail(); // nothing to wait for without receivers
+        }
+        ring.changed.notify_all();
+        if (n <= 0)
+            break;
+    }
+    // closing the read end makes a still running sender die of SIGPIPE
+    close( in );
+}
+
+// passes the stream on to receiver i and finishes it (finished[i]) once it
+// has all of it, without waiting for slower ones. a sink that fails is
+// dropped (failed[i] is set) and the others carry on; the transfer is
+// aborted once no sink is left.
+static void drain_thread( ring_buffer& ring, const vector<stream_sink*>& sinks, size_t i,
+        vector<char>& failed, vector<char>& finished ) {
+    unsigned long long& offset = ring.offsets[i];
+    for (;;) {
+        size_t pos, len;
+        {
+            std::unique_lock<std::mutex> lock( ring.mutex );
+            ring.changed.wait( lock, [&](){ return ring.head > offset || ring.eof || ring.aborted; } );
+            if (ring.aborted)
+                break;
+            if (ring.eof && ring.head == offset) {
+                lock.unlock();
+                if (sinks[i]->finish( false ))
+                    failed[i] = true;
+                finished[i] = true;
+                break;
+            }
+            pos = offset % ring.size;
+            len = std::min( { ring.size - pos, (size_t)(ring.head - offset), (size_t)IO_CHUNK } );
+        }
+        bool ok = !sinks[i]->write( ring.data.get() + pos, len );
+        std::lock_guard<std::mutex> lock( ring.mutex );
+        if (ok) {
+            offset += len;
+        } else {
+            failed[i] = true;
+            ring.alive[i] = false;
+            size_t alive = std::count( ring.alive.begin(), ring.alive.end(), true );
+            if (!alive)
+                ring.aborted = true;
+            else
+                WARN( "transfer: receiver " << i+1 << " of " << sinks.size() << " failed, continuing with " <<
+                        alive << "." );
+        }
+        ring.update_tail();
+        ring.changed.notify_all();
+        if (!ok)
+            break;
+    }
+}
+
+// zero-copy variant for buffer_size = 0: moves pages between the two pipes.
+static void splice_thread( ring_buffer& ring, int in, int out, token_bucket* bucket ) {
+    for (;;) {
+        size_t len = bucket ? bucket->chunk( IO_CHUNK ) : IO_CHUNK;
+        ssize_t n = splice( in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE );
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (bucket && n > 0)
+            bucket->consume( n );
+        std::lock_guard<std::mutex> lock( ring.mutex );
+        if (n <= 0) {
+            ring.eof = true;
+            if (n < 0)
+                ring.aborted = true;
+            ring.changed.notify_all();
+            break;
+        }
+        ring.head += n;
+        ring.tail += n;
+        ring.changed.notify_all();
+    }
+    close( in );
+    close( out );
+}
+
+static void report_progress( ring_buffer& ring, const transfer_options& options,
+        clock_type::time_point start ) {
+    unsigned long long head, tail;
+    {
+        std::lock_guard<std::mutex> lock( ring.mutex );
+        head = ring.head;
+        tail = ring.tail;
+    }
+    double elapsed = std::chrono::duration<double>( clock_type::now() - start ).count();
+    double rate = elapsed > 0.0 ? tail / elapsed : 0.0;
+    string line = format_bytes( tail ) + " sent, " + format_bytes( rate ) + "/s";
+    if (ring.size)
+        line += ", buffer " + std::to_string( (int)(100.0 * (head - tail) / ring.size) ) + "% full";
+    if (options.expected_bytes && rate > 0.0 && options.expected_bytes > tail)
+        line += ", ETA ~" + format_duration( (options.expected_bytes - tail) / rate );
+    INFO( "transfer: " << line );
+}
+
+process_sink::process_sink( const vector<string>& argv ):
+    process_sink( vector<vector<string>>{ argv } ) {}
+
+process_sink::process_sink( const vector<vector<string>>& commands_ ): commands( commands_ ) {
+    int stdin_pipe[2], out[2], err[2];
+    if (pipe2( stdin_pipe, O_CLOEXEC ))
+        return;
+    if (pipe2( out, O_CLOEXEC )) {
+        close( stdin_pipe[0] );
+        close( stdin_pipe[1] );
+        return;
+    }
+    if (pipe2( err, O_CLOEXEC )) {
+        close( stdin_pipe[0] );
+        close( stdin_pipe[1] );
+        close( out[0] );
+        close( out[1] );
+        return;
+    }
+    fcntl( stdin_pipe[0], F_SETPIPE_SZ, PIPE_SIZE );
+    spawn_pipeline( commands, stdin_pipe[0], out[1], err[1], pids );
+    close( stdin_pipe[0] );
+    close( out[1] );
+    close( err[1] );
+    in = stdin_pipe[1];
+    const vector<string>& last = commands.back();
+    string name = last[0].substr( last[0].rfind( '/' ) + 1 );
+    if (name == "btrfs" && last.size() > 1)
+        name = last[1];
+    string tag = log_tag;
+    output_thread = std::thread( [this, out, err, name, tag](){
+        log_tag = tag;
+        follow_output( { out[0], err[0] }, { name, name + "/err" }, &output_tail );
+    } );
+}
+
+process_sink::~process_sink() {
+    if (in >= 0)
+        close( in );
+    wait_pipeline( pids );
+    if (output_thread.joinable())
+        output_thread.join();
+}
+
+int process_sink::write( const char* data, size_t len ) {
+    while (len) {
+        ssize_t n = ::write( in, data, len );
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return EXIT_FAILURE;
+        data += n;
+        len -= n;
+    }
+    return EXIT_SUCCESS;
+}
+
+int process_sink::finish( bool failed ) {
+    (void)failed;
+    if (in >= 0)
+        close( in );
+    in = -1;
+    int status = pids.empty() ? -1 : wait_pipeline( pids );
+    pids.clear();
+    if (output_thread.joinable())
+        output_thread.join();
+    if (status) {
+        ERR( "'" << pipeline_string( commands ) << "' failed with status " << status <<
+                (output_tail.empty() ? "." : ". last output:") );
+        for (auto& line: output_tail)
+            ERR( "  " << line );
+    }
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int transfer_to_sinks( const vector<string>& send_argv, const vector<stream_sink*>& sinks,
+        const transfer_options& options, transfer_stats* stats ) {
+    int send_pipe[2], send_err[2];
+    if (pipe2( send_pipe, O_CLOEXEC )) {
+        ERR( "cannot create pipe." );
+        for (auto sink: sinks)
+            sink->finish( true );
+        return EXIT_FAILURE;
+    }
+    if (pipe2( send_err, O_CLOEXEC )) {
+        ERR( "cannot create pipe." );
+        close( send_pipe[0] );
+        close( send_pipe[1] );
+        for (auto sink: sinks)
+            sink->finish( true );
+        return EXIT_FAILURE;
+    }
+    fcntl( send_pipe[0], F_SETPIPE_SZ, PIPE_SIZE );
+
+    pid_t sender = spawn_process( send_argv, -1, send_pipe[1], send_err[1] );
+    close( send_pipe[1] );
+    close( send_err[1] );
+
+    std::deque<string> output_tail;
+    string tag = log_tag;
+    std::thread output_thread( [&](){
+        log_tag = tag;
+        follow_output( { send_err[0] }, { "send/err" }, &output_tail );
+    } );
+
+    auto start = clock_type::now();
+    // splicing needs a single pipe on the receiving side, and bypasses the
+    // checksum
+    process_sink* splice_sink = sinks.size() == 1 && !options.checksum ?
+        dynamic_cast<process_sink*>( sinks[0] ) : NULL;
+    ring_buffer ring( options.buffer_size || !splice_sink ? std::max( options.buffer_size, (size_t)IO_CHUNK ) : 0,
+            sinks.size() );
+    // the stream is throttled where it is read from the sender
+    std::unique_ptr<token_bucket> bucket( options.bandwidth.unlimited() ? NULL :
+            new token_bucket( options.bandwidth ) );
+    vector<std::thread> threads;
+    vector<char> failed_sinks( sinks.size(), false ), finished_sinks( sinks.size(), false );
+    uint32_t crc = 0;
+    bool sinks_started = true;
+    for (auto sink: sinks) {
+        process_sink* p = dynamic_cast<process_sink*>( sink );
+        if (p && !p->started())
+            sinks_started = false;
+    }
+    if (sender < 0 || !sinks_started) {
+        ERR( "cannot start transfer processes." );
+        close( send_pipe[0] );
+        ring.aborted = true;
+    } else if (ring.size) {
+        threads.emplace_back( [&, tag](){ log_tag = tag; fill_thread( ring, send_pipe[0], bucket.get(),
+                    options.checksum ? &crc : NULL ); } );
+        for (size_t i=0; i<sinks.size(); ++i)
+            threads.emplace_back( [&, tag, i](){ log_tag = tag; drain_thread( ring, sinks, i, failed_sinks,
+                        finished_sinks ); } );
+    } else {
+        int out = splice_sink->release_fd();
+        threads.emplace_back( [&, tag, out](){ log_tag = tag; splice_thread( ring, send_pipe[0], out, bucket.get() ); } );
+    }
+
+    if (!threads.empty()) {
+        std::unique_lock<std::mutex> lock( ring.mutex );
+        auto finished = [&](){ return ring.aborted || (ring.eof && ring.head == ring.tail); };
+        while (!finished()) {
+            if (options.progress_interval) {
+                if (!ring.changed.wait_for( lock, std::chrono::seconds( options.progress_interval ), finished )) {
+                    lock.unlock();
+                    report_progress( ring, options, start );
+                    lock.lock();
+                }
+            } else {
+                ring.changed.wait( lock, finished );
+            }
+        }
+    }
+    bool aborted;
+    {
+        std::lock_guard<std::mutex> lock( ring.mutex );
+        aborted = ring.aborted;
+        ring.aborted = true; // releases a fill thread that waits for space
+        ring.changed.notify_all();
+    }
+    for (auto& t: threads)
+        t.join();
+
+    int sink_status = EXIT_SUCCESS;
+    for (size_t i=0; i<sinks.size(); ++i)
+        if ((!finished_sinks[i] && sinks[i]->finish( aborted || failed_sinks[i] )) || failed_sinks[i])
+            sink_status = EXIT_FAILURE;
+    int send_status = sender > 0 ? wait_process( sender ) : -1;
+    output_thread.join();
+    double seconds = std::chrono::duration<double>( clock_type::now() - start ).count();
+
+    INFO( "transfer: " << format_bytes( ring.tail ) << " in " << format_duration( seconds ) <<
+            " (" << format_bytes( seconds > 0.0 ? ring.tail / seconds : 0.0 ) << "/s, protocol " <<
+            options.protocol << ")" );
+    if (stats) {
+        stats->bytes = ring.tail;
+        stats->seconds = seconds;
+        stats->crc32c = crc;
+    }
+    if (send_status) {
+        ERR( "'" << command_string( send_argv ) << "' failed with status " << send_status <<
+                (output_tail.empty() ? "." : ". last output:") );
+        for (auto& line: output_tail)
+            ERR( "  " << line );
+    }
+    return (send_status || sink_status || aborted) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// send stream layout (fs/btrfs/send.h, not exported to user space)
+#define SEND_STREAM_HEADER 17 // "btrfs-stream\0" and le32 version
+#define SEND_CMD_HEADER 10 // le32 length, le16 command, le32 crc
+#define SEND_TLV_HEADER 4 // le16 type, le16 length
+#define SEND_C_UPDATE_EXTENT 22
+#define SEND_A_SIZE 4
+
+template<typename T> static T load_le( const unsigned char* p ) {
+    T v;
+    memcpy( &v, p, sizeof(v) );
+    return sizeof(T) == 2 ? le16toh( v ) : sizeof(T) == 4 ? le32toh( v ) : le64toh( v );
+}
+
+// data bytes of the update_extent command in cmd, 0 for other commands
+static unsigned long long update_extent_size( const unsigned char* cmd, size_t len ) {
+    if (load_le<uint16_t>( cmd + 4 ) != SEND_C_UPDATE_EXTENT)
+        return 0;
+    for (size_t pos = SEND_CMD_HEADER; pos + SEND_TLV_HEADER <= len; ) {
+        uint16_t type = load_le<uint16_t>( cmd + pos );
+        uint16_t attr_len = load_le<uint16_t>( cmd + pos + 2 );
+        pos += SEND_TLV_HEADER;
+        if (type == SEND_A_SIZE && attr_len == 8 && pos + 8 <= len)
+            return load_le<uint64_t>( cmd + pos );
+        pos += attr_len;
+    }
+    return 0;
+}
+
+int probe_send_size( const vector<string>& send_argv, unsigned long long& bytes ) {
+    int out[2], err[2];
+    if (pipe2( out, O_CLOEXEC ))
+        return EXIT_FAILURE;
+    if (pipe2( err, O_CLOEXEC )) {
+        close( out[0] );
+        close( out[1] );
+        return EXIT_FAILURE;
+    }
+    pid_t pid = spawn_process( send_argv, -1, out[1], err[1] );
+    close( out[1] );
+    close( err[1] );
+    std::deque<string> output_tail;
+    string tag = log_tag;
+    std::thread output_thread( [&](){
+        log_tag = tag;
+        follow_output( { err[0] }, { "probe/err" }, &output_tail );
+    } );
+
+    // commands are parsed as they arrive; pending holds an incomplete one
+    bytes = 0;
+    std::vector<unsigned char> pending;
+    size_t skip = SEND_STREAM_HEADER;
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read( out[0], buf, sizeof(buf) )) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        bytes += n;
+        pending.insert( pending.end(), buf, buf + n );
+        size_t pos = std::min( skip, pending.size() );
+        skip -= pos;
+        while (pending.size() - pos >= SEND_CMD_HEADER) {
+            size_t len = SEND_CMD_HEADER + load_le<uint32_t>( pending.data() + pos );
+            if (pending.size() - pos < len)
+                break;
+            bytes += update_extent_size( pending.data() + pos, len );
+            pos += len;
+        }
+        pending.erase( pending.begin(), pending.begin() + pos );
+    }
+    close( out[0] );
+    int status = pid < 0 ? -1 : wait_process( pid );
+    output_thread.join();
+    if (status) {
+        ERR( "'" << command_string( send_argv ) << "' failed with status " << status <<
+                (output_tail.empty() ? "." : ". last output:") );
+        for (auto& line: output_tail)
+            ERR( "  " << line );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int transfer_stream( const vector<string>& send_argv, const vector<string>& receive_argv,
+        const transfer_options& options, transfer_stats* stats ) {
+    process_sink receiver( receive_argv );
+    return transfer_to_sinks( send_argv, { &receiver }, options, stats );
+}
+
+const send_features& detect_send_features() {
+    static send_features features;
+    static std::once_flag once;
+    std::call_once( once, [](){
+        std::ifstream version( "/sys/fs/btrfs/features/send_stream_version" );
+        if (!(version >> features.kernel_stream_version))
+            features.kernel_stream_version = 1;
+        string help;
+        capture_process( { "btrfs", "send", "--help" }, help );
+        features.progs_compressed_data = help.find( "--compressed-data" ) != string::npos;
+    } );
+    return features;
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <cstddef>
+#include <sys/types.h>
+
+#include "throttle.hpp"
+
+using std::string;
+using std::vector;
+
+struct transfer_options {
+    // bytes buffered between sender and receiver. 0 splices the two pipes
+    // directly without a user space buffer, unless the stream is
+    // checksummed or goes to several sinks.
+    size_t buffer_size = 256ul << 20;
+    // seconds between progress lines, 0 disables them.
+    unsigned progress_interval = 10;
+    // expected stream size for the ETA, 0 if unknown.
+    unsigned long long expected_bytes = 0;
+    // send stream protocol, only used in the log
+    string protocol = "v1";
+    // limit on the rate the send stream is read at
+    bandwidth_schedule bandwidth;
+    // crc32c of the stream as it passes through the buffer (never spliced)
+    bool checksum = false;
+};
+
+struct transfer_stats {
+    unsigned long long bytes = 0;
+    double seconds = 0.0;
+    uint32_t crc32c = 0; // with transfer_options::checksum
+};
+
+// consumer of a send stream.
+class stream_sink {
+    public:
+        virtual ~stream_sink() {}
+        // takes the next len bytes. EXIT_FAILURE aborts the transfer.
+        virtual int write( const char* data, size_t len ) = 0;
+        // called once after the last byte, or after an abort with failed set.
+        virtual int finish( bool failed ) = 0;
+};
+
+// feeds the stream into the stdin of a process (e.g. btrfs receive) or a
+// pipeline of them whose output is logged like in run_process(). finish()
+// waits for all of them.
+class process_sink: public stream_sink {
+    public:
+        process_sink( const vector<string>& argv );
+        process_sink( const vector<vector<string>>& commands );
+        ~process_sink();
+        bool started() const { return !pids.empty(); }
+        int fd() const { return in; }
+        // hands the descriptor over, e.g. to splice into it
+        int release_fd() { int fd = in; in = -1; return fd; }
+        int write( const char* data, size_t len ) override;
+        int finish( bool failed ) override;
+    private:
+        vector<vector<string>> commands;
+        vector<pid_t> pids;
+        int in = -1;
+        std::thread output_thread;
+        std::deque<string> output_tail;
+};
+
+// runs send_argv and pumps its output into the sinks through a buffer filled
+// and drained by separate threads, so several receivers share one read of
+// the source. a failing sink does not stop the others. returns EXIT_SUCCESS
+// if the sender and all sinks succeeded.
+int transfer_to_sinks( const vector<string>& send_argv, const vector<stream_sink*>& sinks,
+        const transfer_options& options, transfer_stats* stats = NULL );
+
+// transfer_to_sinks() with a single receiving process.
+int transfer_stream( const vector<string>& send_argv, const vector<string>& receive_argv,
+        const transfer_options& options, transfer_stats* stats = NULL );
+
+// runs send_argv, a btrfs send --no-data, and estimates the size of the
+// real stream: the metadata stream itself plus the file data each of its
+// update_extent commands stands for.
+int probe_send_size( const vector<string>& send_argv, unsigned long long& bytes );
+
+string format_bytes( unsigned long long bytes );
+
+// what the running kernel and the installed btrfs-progs support for
+// btrfs send. detected once per process.
+struct send_features {
+    unsigned kernel_stream_version = 1;
+    bool progs_compressed_data = false;
+    bool compressed_data() const { return kernel_stream_version >= 2 && progs_compressed_data; }
+};
+const send_features& detect_send_features();
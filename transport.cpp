@@ -0,0 +1,226 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "transport.hpp"
+#include "proc.hpp"
+#include "snap.hpp"
+#include "scan.hpp"
+#include "transfer.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+
+btrfs_transport_backend::btrfs_transport_backend( const vector<string>& command_, string compression_,
+        int level_ ): command( command_ ), compression( compression_ ), level( level_ ) {}
+
+vector<string> btrfs_transport_backend::remote( string line ) const {
+    vector<string> argv = command;
+    argv.push_back( line );
+    return argv;
+}
+
+int btrfs_transport_backend::create_snapshot( string source, string dest, bool read_only ) {
+    (void)read_only;
+    ERR( "cannot snapshot '" << source << "' to '" << dest << "' on the receiving side." );
+    return EXIT_FAILURE;
+}
+
+int btrfs_transport_backend::delete_snapshot( string path ) {
+    return delete_snapshots( { path } );
+}
+
+int btrfs_transport_backend::delete_snapshots( const vector<string>& paths ) {
+    if (paths.empty())
+        return EXIT_SUCCESS;
+    {
+        std::lock_guard<std::mutex> lock( listed_mutex );
+        for (string path: paths) {
+            while (path.size() > 1 && path.back() == '/')
+                path.pop_back();
+            listed.erase( path + "/" );
+        }
+    }
+    vector<string> argv = { "btrfs", "subvolume", "delete" };
+    argv.insert( argv.end(), paths.begin(), paths.end() );
+    return run_process( remote( command_string( argv ) ) );
+}
+
+static string strip( string s ) {
+    s.erase( 0, s.find_first_not_of( " \t" ) );
+    s.erase( s.find_last_not_of( " \t\r" ) + 1 );
+    return s;
+}
+
+// btrfs subvolume show prints uuids with dashes, the ioctls as plain hex
+static string plain_uuid( string uuid ) {
+    if (uuid == "-")
+        return "";
+    string result;
+    for (char c: uuid)
+        if (c != '-')
+            result += c;
+    return result;
+}
+
+// adds one "Key: value" line of btrfs subvolume show to info. show does not
+// print the ctransid, it stays 0 (unknown)
+static void parse_show_line( const string& line, subvolume_info& info ) {
+    size_t colon = line.find( ':' );
+    if (colon == string::npos)
+        return;
+    string key = strip( line.substr( 0, colon ) ), value = strip( line.substr( colon + 1 ) );
+    try {
+        if (key == "UUID")
+            info.uuid = plain_uuid( value );
+        else if (key == "Parent UUID")
+            info.parent_uuid = plain_uuid( value );
+        else if (key == "Received UUID")
+            info.received_uuid = plain_uuid( value );
+        else if (key == "Subvolume ID")
+            info.id = std::stoull( value );
+        else if (key == "Generation")
+            info.generation = std::stoull( value );
+        else if (key == "Gen at creation")
+            info.otransid = std::stoull( value );
+        else if (key == "Flags")
+            info.read_only = value.find( "readonly" ) != string::npos;
+    } catch (std::exception&) {
+        // a warning or banner of the remote login, not ours
+    }
+}
+
+int btrfs_transport_backend::get_subvolume_info( string path, subvolume_info& info ) {
+    {
+        std::lock_guard<std::mutex> lock( listed_mutex );
+        auto cached = listed.find( path );
+        if (cached != listed.end()) {
+            info = cached->second;
+            listed.erase( cached );
+            return EXIT_SUCCESS;
+        }
+    }
+    string output;
+    if (capture_process( remote( command_string( { "btrfs", "subvolume", "show", path } ) ), output ))
+        return EXIT_FAILURE;
+    info = subvolume_info();
+    std::istringstream lines( output );
+    for (string line; std::getline( lines, line ); )
+        parse_show_line( line, info );
+    return info.uuid == "" ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+vector<string> btrfs_transport_backend::send_command( const vector<string>& argv ) {
+    return remote( command_string( argv ) );
+}
+
+vector<vector<string>> btrfs_transport_backend::receive_pipeline( string dir ) {
+    string receive = command_string( { "btrfs", "receive", dir } );
+    if (compression == "zstd")
+        return { { "zstd", "-q", "-T0", "-" + std::to_string( level ), "-c" },
+            remote( "zstd -q -d -c | " + receive ) };
+    if (compression == "lz4")
+        return { { "lz4", "-q", "-" + std::to_string( level ), "-c" },
+            remote( "lz4 -q -d -c | " + receive ) };
+    return { remote( receive ) };
+}
+
+int btrfs_transport_backend::sync_paths( const vector<string>& paths ) {
+    vector<string> argv = { "sync", "-f" };
+    argv.insert( argv.end(), paths.begin(), paths.end() );
+    return run_process( remote( command_string( argv ) ) );
+}
+
+// one round trip lists the snapshots and shows each of them, every block
+// starting with a "snapshot: <name>" line.
+vector<string> btrfs_transport_backend::list_snapshots( string dir, string prefix ) {
+    if (dir.size() && dir.back() != '/')
+        dir += "/";
+    string script = "cd " + command_string( { dir } ) + " || exit 1; for p in " +
+        command_string( { prefix } ) + "*; do [ -d \"$p\" ] || continue; echo \"snapshot: $p\"; "
+        "btrfs subvolume show \"$p\" 2>/dev/null; done; exit 0";
+    string output;
+    if (capture_process( remote( script ), output )) {
+        ERR( "cannot list '" << dir << "' on the receiving side: " << strip( output ) );
+        return {};
+    }
+
+    // the names are held to the same rules as those of local listings
+    vector<snapshot_entry> entries;
+    std::map<string, subvolume_info> infos;
+    std::istringstream lines( output );
+    string current = "";
+    for (string line; std::getline( lines, line ); ) {
+        if (line.compare( 0, 10, "snapshot: " ) == 0) {
+            string name = strip( line.substr( 10 ) );
+            time_t time;
+            current = "";
+            if (name.size() != prefix.size() + 19 || !snapshot_time( name, time ))
+                continue;
+            current = dir + name + "/";
+            entries.push_back( { name, time } );
+            infos[current] = subvolume_info();
+        } else if (current != "") {
+            parse_show_line( line, infos[current] );
+        }
+    }
+    std::sort( entries.begin(), entries.end(), []( const snapshot_entry& a, const snapshot_entry& b ){
+            return a.time != b.time ? a.time < b.time : a.name < b.name; } );
+    vector<string> paths;
+    for (auto& entry: entries)
+        paths.push_back( dir + entry.name + "/" );
+    // what an earlier listing of the series left unused is stale by now
+    string series = dir + prefix;
+    std::lock_guard<std::mutex> lock( listed_mutex );
+    for (auto it = listed.lower_bound( series );
+            it != listed.end() && it->first.compare( 0, series.size(), series ) == 0; )
+        it = listed.erase( it );
+    for (auto& entry: infos)
+        if (entry.second.uuid != "")
+            listed[entry.first] = entry.second;
+    return paths;
+}
+
+bool btrfs_transport_backend::directory_exists( string dir ) {
+    string output;
+    return capture_process( remote( command_string( { "test", "-d", dir } ) ), output ) == 0;
+}
+
+int btrfs_transport_backend::read_file( string path, string& contents ) {
+    string quoted = command_string( { path } );
+    return capture_process( remote( "[ ! -e " + quoted + " ] || cat " + quoted ), contents );
+}
+
+// the contents go through stdin, a command line argument would fail past
+// ARG_MAX
+int btrfs_transport_backend::write_file( string path, const string& contents ) {
+    string tmp = command_string( { path + ".tmp" } );
+    process_sink writer( remote( "cat > " + tmp + " && mv " + tmp + " " + command_string( { path } ) ) );
+    if (!writer.started())
+        return EXIT_FAILURE;
+    int written = writer.write( contents.data(), contents.size() );
+    return writer.finish( written ) || written ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+btrfs_backend* get_transport_backend( string transport, string compression, int level ) {
+    if (compression == "none")
+        level = 0;
+    else if (!((compression == "zstd" && level >= 1 && level <= 19) ||
+                (compression == "lz4" && level >= 1 && level <= 12)))
+        return NULL;
+
+    static std::mutex mutex;
+    static std::map<string, std::unique_ptr<btrfs_transport_backend>> backends;
+    std::lock_guard<std::mutex> lock( mutex );
+    auto& backend = backends[transport + "\n" + compression + "\n" + std::to_string( level )];
+    if (!backend) {
+        vector<string> command;
+        std::istringstream words( transport );
+        for (string word; words >> word; )
+            command.push_back( word );
+        backend.reset( new btrfs_transport_backend( command, compression, level ) );
+    }
+    return backend.get();
+}
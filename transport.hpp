@@ -0,0 +1,52 @@
+#pragma once
+
+#include "backend.hpp"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+using std::string;
+using std::vector;
+
+// reaches remote snapshot dirs on another host. command (e.g. "ssh
+// backup@nas" or "sh -c" as a local stand-in) gets a shell command line as
+// its last argument and runs it on the receiving side; listing, subvolume
+// info, receive, deletion and sync all go through it. streams can be
+// compressed on the way with "zstd" (all cores) or "lz4" at level, which
+// needs the same tool on both sides.
+class btrfs_transport_backend: public btrfs_backend {
+    public:
+        btrfs_transport_backend( const vector<string>& command, string compression, int level );
+        string name() const override { return "transport"; }
+        int create_snapshot( string source, string dest, bool read_only ) override;
+        int delete_snapshot( string path ) override;
+        int delete_snapshots( const vector<string>& paths ) override;
+        int get_subvolume_info( string path, subvolume_info& info ) override;
+        // sends from the receiving side, for verification
+        vector<string> send_command( const vector<string>& command ) override;
+        vector<vector<string>> receive_pipeline( string dir ) override;
+        int sync_paths( const vector<string>& paths ) override;
+        vector<string> list_snapshots( string dir, string prefix ) override;
+        bool directory_exists( string dir ) override;
+        int read_file( string path, string& contents ) override;
+        int write_file( string path, const string& contents ) override;
+    private:
+        // argv that runs the shell command line on the receiving side
+        vector<string> remote( string command ) const;
+        vector<string> command;
+        string compression;
+        int level;
+        // subvolume info gathered by the last listing, so matching the
+        // listed snapshots takes no round trip each. entries are used once
+        // and dropped when their snapshot is deleted or its directory
+        // listed again.
+        std::mutex listed_mutex;
+        std::map<string, subvolume_info> listed;
+};
+
+// the transport backend for a transport command line and compression
+// ("none", "zstd" or "lz4"), shared by all sections that use the same.
+// NULL if the compression is unknown or its level out of range.
+btrfs_backend* get_transport_backend( string transport, string compression, int level );
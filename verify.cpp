@@ -0,0 +1,172 @@
+/*
+ * author: alcubierre-drive
+ * license: gpl-v3
+ */
+
+#include "verify.hpp"
+#include "backend.hpp"
+#include "transfer.hpp"
+#include "metrics.hpp"
+#include "proc.hpp"
+
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <cstdio>
+
+string sums_path( string dir, string prefix ) {
+    if (dir.size() && dir.back() != '/')
+        dir += "/";
+    while (prefix.size() && prefix.back() == '_')
+        prefix.pop_back();
+    return dir + ".btrfs-snap-sums-" + prefix;
+}
+
+static string hex32( uint32_t value ) {
+    char buf[16];
+    snprintf( buf, sizeof(buf), "%08x", value );
+    return buf;
+}
+
+// one tab separated line per snapshot: name, parent, crc, bytes,
+// verify crc, verify bytes, verification time
+static std::map<string, stream_sum> read_sums( btrfs_backend* backend, string path ) {
+    std::map<string, stream_sum> sums;
+    string data;
+    if (backend->read_file( path, data ))
+        return sums;
+    std::istringstream in( data );
+    for (string line; std::getline( in, line ); ) {
+        std::istringstream fields( line );
+        stream_sum sum;
+        string crc, verify_crc;
+        bool ok = std::getline( fields, sum.name, '\t' ) && std::getline( fields, sum.parent, '\t' ) &&
+            fields >> crc >> sum.bytes >> verify_crc >> sum.verify_bytes >> sum.verified && sum.name != "";
+        try {
+            if (ok) {
+                sum.crc = std::stoul( crc, NULL, 16 );
+                sum.verify_crc = std::stoul( verify_crc, NULL, 16 );
+            }
+        } catch (const std::logic_error&) {
+            ok = false;
+        }
+        if (ok)
+            sums[sum.name] = sum;
+        else if (line != "")
+            WARN( "ignoring malformed line in '" << path << "'." );
+    }
+    return sums;
+}
+
+static int write_sums( btrfs_backend* backend, string path, const std::map<string, stream_sum>& sums ) {
+    std::ostringstream out;
+    for (auto& entry: sums) {
+        const stream_sum& sum = entry.second;
+        out << sum.name << "\t" << sum.parent << "\t" << hex32( sum.crc ) << "\t" << sum.bytes << "\t" <<
+            hex32( sum.verify_crc ) << "\t" << sum.verify_bytes << "\t" << sum.verified << "\n";
+    }
+    if (backend->write_file( path, out.str() )) {
+        ERR( "cannot write stream sums '" << path << "'." );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int record_stream_sum( btrfs_backend* backend, string dir, string prefix, const stream_sum& sum ) {
+    string path = sums_path( dir, prefix );
+    std::map<string, stream_sum> sums = read_sums( backend, path );
+    sums[sum.name] = sum;
+    // its first verification waits an interval like any other, so new
+    // snapshots do not starve the older ones
+    sums[sum.name].verified = time( NULL );
+    return write_sums( backend, path, sums );
+}
+
+namespace {
+// counts and forgets the stream, only its checksum is of interest
+class discard_sink: public stream_sink {
+    public:
+        int write( const char* data, size_t len ) override {
+            (void)data; (void)len;
+            return EXIT_SUCCESS;
+        }
+        int finish( bool failed ) override { return failed ? EXIT_FAILURE : EXIT_SUCCESS; }
+};
+}
+
+int check_stream_sums( const snapshot_setup& setup, btrfs_backend* backend, string dir,
+        const vector<string>& present ) {
+    if (dir.size() && dir.back() != '/')
+        dir += "/";
+    string prefix = setup.host_name + "_" + setup.backup_name + "_";
+    string path = sums_path( dir, prefix );
+    std::map<string, stream_sum> sums = read_sums( backend, path );
+    std::set<string> names;
+    for (auto& p: present)
+        names.insert( base_name( p ) );
+    bool changed = false;
+    for (auto it = sums.begin(); it != sums.end(); ) {
+        if (names.count( it->first )) {
+            ++it;
+        } else {
+            it = sums.erase( it );
+            changed = true;
+        }
+    }
+
+    int result = EXIT_SUCCESS;
+    string due = "";
+    time_t now = time( NULL );
+    auto verified = [&]( const string& name ){
+        auto it = sums.find( name );
+        return it == sums.end() ? (time_t)0 : it->second.verified;
+    };
+    if (setup.verify_interval) {
+        // snapshots received before sums were kept are verified too
+        for (auto& name: names)
+            if (now - verified( name ) >= (time_t)setup.verify_interval &&
+                    (due == "" || verified( name ) < verified( due )))
+                due = name;
+    }
+    if (due != "") {
+        stream_sum& sum = sums[due];
+        sum.name = due;
+        vector<string> send = backend->send_command( { "btrfs", "send", dir + due } );
+        INFO( "verify: " << command_string( send ) << " | crc32c" );
+        if (setup.dry_run)
+            return EXIT_SUCCESS;
+        phase_timer timer( "verify" );
+        transfer_options options;
+        options.buffer_size = 16ul << 20;
+        options.progress_interval = setup.progress_interval;
+        options.checksum = true;
+        transfer_stats stats;
+        discard_sink sink;
+        if (transfer_to_sinks( send, { &sink }, options, &stats )) {
+            ERR( "verify: cannot send '" << due << "' from '" << dir << "'." );
+            return EXIT_FAILURE;
+        }
+        timer.add_bytes( stats.bytes );
+        if (!sum.verify_bytes) {
+            INFO( "verify: '" << due << "' sends " << format_bytes( stats.bytes ) << " with crc32c " <<
+                    hex32( stats.crc32c ) << ", trusted as reference for later checks." );
+            sum.verify_crc = stats.crc32c;
+            sum.verify_bytes = stats.bytes;
+        } else if (sum.verify_crc != stats.crc32c || sum.verify_bytes != stats.bytes) {
+            ERR( "verify: '" << dir << due << "' changed: crc32c " << hex32( stats.crc32c ) << " of " <<
+                    stats.bytes << " bytes, expected " << hex32( sum.verify_crc ) << " of " <<
+                    sum.verify_bytes << " bytes." );
+            result = EXIT_FAILURE;
+        } else {
+            INFO( "verify: '" << due << "' unchanged (crc32c " << hex32( stats.crc32c ) << ")." );
+        }
+        sum.verified = now;
+        changed = true;
+    }
+
+    if (changed && !setup.dry_run && write_sums( backend, path, sums ))
+        result = EXIT_FAILURE;
+    return result;
+}
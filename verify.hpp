@@ -0,0 +1,45 @@
+#pragma once
+
+#include "snap.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ctime>
+
+using std::string;
+using std::vector;
+
+class btrfs_backend;
+
+// what is known about the stream of one remote snapshot: the crc32c and
+// size of the stream it was received from, and of the full stream it sends
+// itself on the receiving side. the latter is taken by its first
+// verification (trust on first use: the received stream has other uuids and
+// inode numbers, and is mostly incremental, so the two never match) and
+// compared by every later one. sizes of 0 are unknown;
+// verified is the time of the last verification, or of the receive.
+struct stream_sum {
+    string name;
+    string parent;
+    uint32_t crc = 0;
+    unsigned long long bytes = 0;
+    uint32_t verify_crc = 0;
+    unsigned long long verify_bytes = 0;
+    time_t verified = 0;
+};
+
+// file next to the snapshots of series prefix in dir holding their sums
+string sums_path( string dir, string prefix );
+
+// records sum for a snapshot just received into dir, replacing an older
+// entry of the same name
+int record_stream_sum( btrfs_backend* backend, string dir, string prefix, const stream_sum& sum );
+
+// drops the sums of snapshots in dir that are not in present. with
+// setup.verify_interval, the present snapshot verified longest ago (if
+// that was at least verify_interval ago) is sent on the receiving side
+// and its stream checked against the recorded one; one per call, so the
+// reads are spread over the runs. EXIT_FAILURE on a mismatch.
+int check_stream_sums( const snapshot_setup& setup, btrfs_backend* backend, string dir,
+        const vector<string>& present );